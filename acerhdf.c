@@ -38,8 +38,8 @@
  * 
  * Please do not forget to do a PR to make life easier for others
  * 
- * The current fancontrol table is hardcoded in function acerhdf_set_cur_state
- * It is quite aggressive, you can adjust it according to your requirements.
+ * The default fan curve is ACERHDF_DEFAULT_CURVE in acerhdf_ctl.h, it is quite aggressive.
+ * Adjust it at runtime through the curve module parameter.
  * 
  * TODO:
  *      - code cleanup
@@ -50,11 +50,15 @@
  */
 
 //*****************Predator settings *******************************************
-//Calculate AVG temperatue from X samles, one sample 1s
-#define TEMPERATURE_SAMPLES  10
+//Filter window, fan limits and the default curve live in acerhdf_ctl.h
 
-//Minimal allowed Fan speed
-#define MIN_FAN_SPEED 4
+/*
+ * Default package power feed-forward curve, "watts:state" points, used with
+ * power_ff enabled. The i7-8750H is a 45W TDP part with a ~90W turbo limit.
+ */
+#define ACERHDF_DEFAULT_POWER_CURVE "0:0,45:8,65:10,85:11"
+/* GPU fan, if the model has one, the GPU runs hotter than the CPU */
+#define ACERHDF_DEFAULT_GPU_CURVE "0:3,50:4,60:6,70:8,75:10,80:11"
 
 /*
  * According to the i7-8750H datasheet,
@@ -65,7 +69,7 @@
 #define ACERHDF_TEMP_CRIT 89
 
 
-static int fan_speed_debug = 0; //enable debug messages to dmesg
+static unsigned int fan_speed_debug = 0; //enable debug messages to dmesg
 static unsigned int verbose = 0; //show orig driver debug messages
 //******************************************************************************
 #define pr_fmt(fmt) "acerhdf: " fmt
@@ -76,6 +80,31 @@ static unsigned int verbose = 0; //show orig driver debug messages
 #include <linux/acpi.h>
 #include <linux/thermal.h>
 #include <linux/platform_device.h>
+#include <linux/sched.h>
+#include <linux/mutex.h>
+#include <linux/math64.h>
+#include <linux/rcupdate.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/hrtimer.h>
+#include <linux/workqueue.h>
+#include <linux/jump_label.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/sort.h>
+#include <linux/completion.h>
+#include <linux/hwmon.h>
+#include <linux/miscdevice.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/log2.h>
+#include <asm/cpufeature.h>
+#include <asm/msr.h>
+
+#define CREATE_TRACE_POINTS
+#include "acerhdf_trace.h"
+#include "acerhdf_ring.h"
+#include "acerhdf_ctl.h"
 
 /*
  * The driver is started with "kernel mode off" by default. That means, the BIOS
@@ -97,7 +126,7 @@ static unsigned int verbose = 0; //show orig driver debug messages
  * No matter what value the user puts into the fanon variable, turn on the fan
  * at 80 degree Celsius to prevent hardware damage
  */
-#define ACERHDF_MAX_FANON 80000
+#define ACERHDF_MAX_FANON 80
 
 /*
  * Maximum interval between two temperature checks is 15 seconds, as the die
@@ -106,40 +135,232 @@ static unsigned int verbose = 0; //show orig driver debug messages
  */
 #define ACERHDF_MAX_INTERVAL 15
 
+/* an unchanged fan state is rewritten at least once an hour if at all */
+#define ACERHDF_MAX_FAN_REFRESH 3600
+
 #ifdef START_IN_KERNEL_MODE
 static int kernelmode = 1;
 #else
 static int kernelmode = 1;
 #endif
 
-static unsigned int interval = 1;
-static unsigned int fanon = 30;
-static unsigned int fanoff = 53000;
+/*
+ * Polling interval (s), trip point (degrees) and fan state refresh (s). The
+ * parameter setters validate a write and publish a new snapshot, so readers
+ * take whatever snapshot is current without checking it again.
+ */
+struct acerhdf_config {
+    struct rcu_head rcu;
+    unsigned int interval;
+    unsigned int fanon;
+    unsigned int fanoff;
+    unsigned int fan_refresh;
+};
+
+static struct acerhdf_config acerhdf_default_config = {
+    .interval = 1,
+    .fanon = 30,
+    .fanoff = 23,
+    .fan_refresh = 30,
+};
+
+static struct acerhdf_config __rcu *cur_config =
+        RCU_INITIALIZER(&acerhdf_default_config);
+static DEFINE_MUTEX(acerhdf_config_lock);
+/* fanoff <= fanon is enforced on writes once the load-time values are in */
+static bool config_checked;
+
+#define acerhdf_config_get(field) ({                        \
+    unsigned int __v;                                       \
+    rcu_read_lock();                                        \
+    __v = rcu_dereference(cur_config)->field;                   \
+    rcu_read_unlock();                                      \
+    __v;                                                    \
+})
+
+/*
+ * The EC temperature is read once per poll cycle: the thermal zone callback
+ * fills this cache and the cooling device (and any sysfs reader in the same
+ * cycle) reuses it instead of going to the EC again.
+ */
+#define ACERHDF_SAMPLE_MAX_AGE (HZ / 2)
+
+struct acerhdf_sample {
+    int temp;
+    int dts;
+    int input;
+    unsigned long stamp;
+    ktime_t time;
+    unsigned int seq;
+    bool valid;
+};
+
+static struct acerhdf_sample ec_sample;
+static DEFINE_MUTEX(acerhdf_sample_lock);
+
+/* current polling interval, fixed or chosen by adaptive polling */
+static unsigned int poll_delay_ms = 1000;
 
-static int samples[TEMPERATURE_SAMPLES];
-static int current_sample = 0;
+/*
+ * Last fan state written to and acknowledged by the EC, -1 if unknown.
+ * Writes of an unchanged state are skipped, but the register is rewritten
+ * every fan_refresh seconds in case something else touched it.
+ */
+static int fan_written = -1;
+static unsigned long fan_written_at;
+
+/* CPU fan state set through hwmon pwm1 with pwm1_enable = 1, -1 if none */
+static int manual_state = -1;
+
+/* log2 histogram of EC access latency, bucket n counts [2^(n-1), 2^n) us */
+#define ACERHDF_LATENCY_BUCKETS 16
+
+/* control loop statistics, exported through debugfs and reset from there */
+struct acerhdf_stats {
+    u64 ec_reads;
+    u64 ec_read_errors;
+    u64 ec_writes;
+    u64 ec_write_errors;
+    u64 writes_elided;
+    u64 transitions;
+    u64 bios_reverts;
+    u64 state_ns[ACERHDF_MAX_STATE + 1];
+    u64 bios_ns;
+    int state;
+    ktime_t state_since;
+    u64 steps;
+    u64 step_min_ns;
+    u64 step_max_ns;
+    u64 step_sum_ns;
+    u64 ec_latency[ACERHDF_LATENCY_BUCKETS];
+    u64 ec_budget_overruns;
+    u64 ec_batches;
+    u64 ec_batch_latency[ACERHDF_LATENCY_BUCKETS];
+};
 
+static struct acerhdf_stats stats = {
+    .state = -1,
+    .step_min_ns = U64_MAX,
+};
 
 
 static unsigned int list_supported;
 static unsigned int fanstate = ACERHDF_FAN_AUTO;
 static char force_bios[16];
 static char force_product[16];
-static unsigned int prev_interval;
 static struct thermal_zone_device *thz_dev;
 static struct thermal_cooling_device *cl_dev;
 static struct platform_device *acerhdf_dev;
 
+/*
+ * Wake up poll()/select() waiters on a platform device attribute. The
+ * fan_state, mode, emergency and temp_band attributes are notified when
+ * they change, so daemons don't have to poll the thermal sysfs files.
+ */
+static void acerhdf_notify(const char *attr) {
+    if (acerhdf_dev)
+        sysfs_notify(&acerhdf_dev->dev.kobj, NULL, attr);
+}
+
+/*
+ * unsigned module parameter restricted to [min, max], apply() publishes the
+ * validated value if the change needs more than a plain store
+ */
+struct acerhdf_uint_param {
+    unsigned int *val;
+    unsigned int min;
+    unsigned int max;
+    void (*apply)(unsigned int *val, unsigned int v);
+};
+
+static int acerhdf_set_uint(const char *val, const struct kernel_param *kp) {
+    const struct acerhdf_uint_param *p = kp->arg;
+    unsigned int v;
+    int err;
+
+    err = kstrtouint(val, 0, &v);
+    if (err)
+        return err;
+    if (v < p->min || v > p->max)
+        return -ERANGE;
+
+    if (p->apply)
+        p->apply(p->val, v);
+    else
+        WRITE_ONCE(*p->val, v);
+
+    return 0;
+}
+
+static int acerhdf_get_uint(char *buf, const struct kernel_param *kp) {
+    const struct acerhdf_uint_param *p = kp->arg;
+
+    return sprintf(buf, "%u\n", *p->val);
+}
+
+static const struct kernel_param_ops acerhdf_uint_ops = {
+    .set = acerhdf_set_uint,
+    .get = acerhdf_get_uint,
+};
+
 module_param(kernelmode, uint, 0);
 MODULE_PARM_DESC(kernelmode, "Kernel mode fan control on / off");
-module_param(interval, uint, 0600);
-MODULE_PARM_DESC(interval, "Polling interval of temperature check");
-module_param(fanon, uint, 0600);
-MODULE_PARM_DESC(fanon, "Turn the fan on above this temperature");
-module_param(fanoff, uint, 0600);
-MODULE_PARM_DESC(fanoff, "Turn the fan off below this temperature");
-module_param(verbose, uint, 0600);
+/*
+ * Debug output is gated by static keys, so it costs nothing while off.
+ * The control loop itself is better observed through the acerhdf tracepoints.
+ */
+static DEFINE_STATIC_KEY_FALSE(acerhdf_debug_key);
+static DEFINE_STATIC_KEY_FALSE(acerhdf_verbose_key);
+
+#define acerhdf_debug() static_branch_unlikely(&acerhdf_debug_key)
+#define acerhdf_verbose() static_branch_unlikely(&acerhdf_verbose_key)
+
+struct acerhdf_flag_param {
+    unsigned int *val;
+    struct static_key_false *key;
+};
+
+static int acerhdf_set_flag(const char *val, const struct kernel_param *kp) {
+    const struct acerhdf_flag_param *p = kp->arg;
+    unsigned int v;
+    int err;
+
+    err = kstrtouint(val, 0, &v);
+    if (err)
+        return err;
+
+    *p->val = v;
+    if (v)
+        static_branch_enable(p->key);
+    else
+        static_branch_disable(p->key);
+
+    return 0;
+}
+
+static int acerhdf_get_flag(char *buf, const struct kernel_param *kp) {
+    const struct acerhdf_flag_param *p = kp->arg;
+
+    return sprintf(buf, "%u\n", *p->val);
+}
+
+static const struct kernel_param_ops acerhdf_flag_ops = {
+    .set = acerhdf_set_flag,
+    .get = acerhdf_get_flag,
+};
+
+static const struct acerhdf_flag_param verbose_param = {
+    &verbose, &acerhdf_verbose_key
+};
+static const struct acerhdf_flag_param fan_speed_debug_param = {
+    &fan_speed_debug, &acerhdf_debug_key
+};
+
+module_param_cb(verbose, &acerhdf_flag_ops, &verbose_param, 0600);
 MODULE_PARM_DESC(verbose, "Enable verbose dmesg output");
+module_param_cb(fan_speed_debug, &acerhdf_flag_ops, &fan_speed_debug_param,
+        0600);
+MODULE_PARM_DESC(fan_speed_debug, "Log every fan state and averaged temperature");
 module_param(list_supported, uint, 0600);
 MODULE_PARM_DESC(list_supported, "List supported models and BIOS versions");
 module_param_string(force_bios, force_bios, 16, 0);
@@ -177,6 +398,9 @@ struct bios_settings {
     u8 tempreg;
     struct fancmd cmd;
     int mcmd_enable;
+    const char *inputs;
+    u8 gpu_fanreg;
+    u8 gpu_tempreg;
 };
 
 /* This could be a daughter struct in the above, but not worth the redirect */
@@ -185,6 +409,8 @@ struct ctrl_settings {
     u8 tempreg;
     struct fancmd cmd;
     int mcmd_enable;
+    u8 gpu_fanreg;
+    u8 gpu_tempreg;
 };
 
 static struct ctrl_settings ctrl_cfg __read_mostly;
@@ -192,314 +418,2972 @@ static struct ctrl_settings ctrl_cfg __read_mostly;
 /* Register addresses and values for different BIOS versions */
 static const struct bios_settings bios_tbl[] __initconst = {
     /* Acer Predator PH517-51/Cayman_CFS, BIOS V1.06 05/03/2018   */
+    /*
+     * no extra EC temperature registers known yet, see extra_inputs; the
+     * GPU fan registers are not identified yet either, see gpu_fanreg
+     */
     {"Acer", "Predator PH517-51", "V1.06", 0x4f, 0x58,
-        {0x14, 0x04}, 1},
+        {0x14, 0x04}, 1, NULL, 0, 0},
     /* pewpew-terminator */
     {"", "", "", 0, 0,
-        {0, 0}, 0}
+        {0, 0}, 0, NULL, 0, 0}
+};
+
+/*
+ * this struct is used to instruct thermal layer to use bang_bang instead of
+ * default governor for acerhdf
+ */
+static struct thermal_zone_params acerhdf_zone_params = {
+    .governor_name = "bang_bang",
+};
+
+static void acerhdf_ec_account(u64 *hist, s64 ns) {
+    int bucket = ns > 0 ? fls64(div_u64(ns, NSEC_PER_USEC)) : 0;
+
+    hist[min(bucket, ACERHDF_LATENCY_BUCKETS - 1)]++;
+}
+
+/*
+ * EC batches. All register accesses of one control cycle - the temperature
+ * read and the conditional fan write - are done inside one batch, which
+ * keeps our own accessors (thermal core callbacks, resume, mode switches)
+ * from interleaving with it and measures the whole window from the first
+ * access to the end. Batches nest, so helpers can open one unconditionally.
+ */
+struct acerhdf_ec_batch {
+    struct task_struct *owner;
+    unsigned int depth;
+    unsigned int ops;
+    ktime_t first;
+    s64 last_ns;
+    bool hold;
+    bool adopt;
+    unsigned int held_ops;
+    ktime_t held_first;
+};
+
+static DEFINE_MUTEX(acerhdf_ec_lock);
+static struct acerhdf_ec_batch ec_batch;
+
+static void acerhdf_ec_batch_begin(void) {
+    if (READ_ONCE(ec_batch.owner) == current) {
+        ec_batch.depth++;
+        return;
+    }
+
+    mutex_lock(&acerhdf_ec_lock);
+    WRITE_ONCE(ec_batch.owner, current);
+    ec_batch.depth = 1;
+    ec_batch.ops = 0;
+    ec_batch.hold = false;
+    ec_batch.adopt = false;
+}
+
+static void acerhdf_ec_batch_account(ktime_t first) {
+    ec_batch.last_ns = ktime_to_ns(ktime_sub(ktime_get(), first));
+    stats.ec_batches++;
+    acerhdf_ec_account(stats.ec_batch_latency, ec_batch.last_ns);
+}
+
+/*
+ * The thermal core reads the zone in its own batch right before it runs the
+ * control step. Such a batch is held back instead of accounted, and the step
+ * that follows adopts it, so a cycle still counts as one window from the
+ * temperature read to the fan write. A held window nobody adopts is accounted
+ * on its own once the next one is held.
+ */
+static void acerhdf_ec_batch_end(void) {
+    if (--ec_batch.depth)
+        return;
+
+    ec_batch.last_ns = 0;
+    if (ec_batch.ops && ec_batch.hold) {
+        if (ec_batch.held_ops)
+            acerhdf_ec_batch_account(ec_batch.held_first);
+        ec_batch.held_first = ec_batch.first;
+        ec_batch.held_ops = ec_batch.ops;
+    } else if (ec_batch.adopt && ec_batch.held_ops) {
+        ec_batch.held_ops = 0;
+        acerhdf_ec_batch_account(ec_batch.held_first);
+    } else if (ec_batch.ops) {
+        acerhdf_ec_batch_account(ec_batch.first);
+    }
+    WRITE_ONCE(ec_batch.owner, NULL);
+    mutex_unlock(&acerhdf_ec_lock);
+}
+
+/* note an access done inside the current batch */
+static void acerhdf_ec_batch_op(ktime_t start) {
+    if (READ_ONCE(ec_batch.owner) != current)
+        return;
+    if (!ec_batch.ops++)
+        ec_batch.first = start;
+}
+
+/* account a read started at start, acerhdf_ec_lock held */
+static void acerhdf_ec_read_done(u8 reg, u8 val, int err, ktime_t start,
+        s64 ns) {
+    stats.ec_reads++;
+    if (err)
+        stats.ec_read_errors++;
+    acerhdf_ec_account(stats.ec_latency, ns);
+    acerhdf_ec_batch_op(start);
+    trace_acerhdf_ec_access(reg, err ? 0 : val, false, err, ns);
+}
+
+/* every EC register access of the driver goes through these two */
+static int acerhdf_ec_read(u8 reg, u8 *val) {
+    ktime_t start = ktime_get();
+    int err;
+
+    err = ec_read(reg, val);
+    acerhdf_ec_read_done(reg, *val, err, start,
+            ktime_to_ns(ktime_sub(ktime_get(), start)));
+
+    return err;
+}
+
+static int acerhdf_ec_write(u8 reg, u8 val) {
+    ktime_t start = ktime_get();
+    s64 ns;
+    int err;
+
+    err = ec_write(reg, val);
+    ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+    stats.ec_writes++;
+    if (err)
+        stats.ec_write_errors++;
+    acerhdf_ec_account(stats.ec_latency, ns);
+    acerhdf_ec_batch_op(start);
+    trace_acerhdf_ec_access(reg, val, true, err, ns);
+
+    return err;
+}
+
+static int acerhdf_read_ec_temp(int *temp) {
+    u8 read_temp;
+
+    if (acerhdf_ec_read(ctrl_cfg.tempreg, &read_temp))
+        return -EINVAL;
+
+    *temp = read_temp;
+
+    return 0;
+}
+
+/*
+ * Latency budget for temperature reads. ec_read() can stall for tens of ms
+ * while the EC is busy with battery SMBus traffic. With ec_budget_us set the
+ * read runs from a work item and the poll waits at most the budget for it;
+ * past that the cycle goes on with the last good sample and the late read
+ * is left to finish on its own. The requester holds acerhdf_ec_lock while
+ * it waits, so the read belongs to its window; the worker accounts the read
+ * under the lock once it is done. No new read is started while one is still
+ * in flight. The last sample is reused for ACERHDF_SAMPLE_REUSE_POLLS poll
+ * periods at most, a wedged EC then fails the read and control goes back to
+ * the BIOS.
+ */
+#define ACERHDF_SAMPLE_REUSE_POLLS 3
+
+struct acerhdf_ec_async {
+    struct work_struct work;
+    struct completion done;
+    bool busy;
+    int temp;
+    int err;
+};
+
+static unsigned int ec_budget_us;
+static struct acerhdf_ec_async ec_async;
+
+module_param(ec_budget_us, uint, 0600);
+MODULE_PARM_DESC(ec_budget_us, "Reuse the last temperature if an EC read takes longer (us), 0 = wait");
+
+static void acerhdf_ec_async_work(struct work_struct *work) {
+    ktime_t start = ktime_get();
+    u8 val = 0;
+    int err;
+    s64 ns;
+
+    err = ec_read(ctrl_cfg.tempreg, &val);
+    ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+    ec_async.err = err ? -EINVAL : 0;
+    ec_async.temp = val;
+    complete(&ec_async.done);
+
+    /* a requester still in its cycle keeps the lock until the cycle ends */
+    mutex_lock(&acerhdf_ec_lock);
+    acerhdf_ec_read_done(ctrl_cfg.tempreg, val, err, start, ns);
+    mutex_unlock(&acerhdf_ec_lock);
+
+    /* only now may a new request reinit done and reuse temp and err */
+    smp_store_release(&ec_async.busy, false);
+}
+
+/* -ETIMEDOUT if the read didn't finish within the budget */
+static int acerhdf_read_ec_temp_bounded(int *temp, unsigned int budget_us) {
+    ktime_t start;
+
+    if (smp_load_acquire(&ec_async.busy))
+        return -ETIMEDOUT;
+
+    start = ktime_get();
+    reinit_completion(&ec_async.done);
+    ec_async.busy = true;
+    queue_work(system_highpri_wq, &ec_async.work);
+
+    if (!wait_for_completion_timeout(&ec_async.done,
+            max_t(unsigned long, usecs_to_jiffies(budget_us), 1)))
+        return -ETIMEDOUT;
+
+    /* the worker is not the batch owner, account its access here */
+    acerhdf_ec_batch_op(start);
+    if (ec_async.err)
+        return ec_async.err;
+    *temp = ec_async.temp;
+
+    return 0;
+}
+
+/* load-time self benchmark of the temperature read, reported in the log */
+static unsigned int ec_bench = 32;
+
+module_param(ec_bench, uint, 0400);
+MODULE_PARM_DESC(ec_bench, "Number of timed EC reads at load time, 0 = off");
+
+static int __init acerhdf_cmp_u64(const void *a, const void *b) {
+    u64 x = *(const u64 *) a, y = *(const u64 *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+static void __init acerhdf_ec_benchmark(void) {
+    unsigned int i, n = min(ec_bench, 1024U);
+    u64 *ns;
+    ktime_t start;
+    u8 val;
+
+    if (!n)
+        return;
+
+    ns = kmalloc_array(n, sizeof (*ns), GFP_KERNEL);
+    if (!ns)
+        return;
+
+    for (i = 0; i < n; i++) {
+        start = ktime_get();
+        if (acerhdf_ec_read(ctrl_cfg.tempreg, &val)) {
+            pr_warn("EC benchmark: read failed after %u samples\n", i);
+            goto out;
+        }
+        ns[i] = ktime_to_ns(ktime_sub(ktime_get(), start));
+    }
+
+    sort(ns, n, sizeof (*ns), acerhdf_cmp_u64, NULL);
+    pr_info("EC read latency over %u reads: p50 %llu us, p99 %llu us, "
+            "max %llu us\n", n, div_u64(ns[n / 2], NSEC_PER_USEC),
+            div_u64(ns[(n * 99) / 100], NSEC_PER_USEC),
+            div_u64(ns[n - 1], NSEC_PER_USEC));
+out:
+    kfree(ns);
+}
+
+/*
+ * Control input. The EC register has 1 degree resolution and lags the die by
+ * seconds; the package digital thermal sensor follows it within ms. It is
+ * read from IA32_PACKAGE_THERM_STATUS like x86_pkg_temp does, going through
+ * thermal_zone_get_temp() would nest that zone's lock inside ours. The EC
+ * stays the fallback whenever the DTS is missing or its reading invalid.
+ */
+enum acerhdf_input {
+    ACERHDF_INPUT_EC,
+    ACERHDF_INPUT_DTS,
+    ACERHDF_INPUT_MAX,
+    ACERHDF_INPUT_FUSED,
+};
+
+static const char * const acerhdf_input_names[] = {
+    [ACERHDF_INPUT_EC] = "ec",
+    [ACERHDF_INPUT_DTS] = "dts",
+    [ACERHDF_INPUT_MAX] = "max",
+    [ACERHDF_INPUT_FUSED] = "fused",
+};
+
+struct acerhdf_dts {
+    bool available;
+    int tjmax;
+};
+
+static unsigned int input = ACERHDF_INPUT_EC;
+static struct acerhdf_dts dts;
+
+static int acerhdf_set_input(const char *val, const struct kernel_param *kp) {
+    int src = sysfs_match_string(acerhdf_input_names, val);
+
+    if (src < 0)
+        return src;
+
+    WRITE_ONCE(input, src);
+    return 0;
+}
+
+static int acerhdf_get_input(char *buf, const struct kernel_param *kp) {
+    return sprintf(buf, "%s\n", acerhdf_input_names[input]);
+}
+
+static const struct kernel_param_ops acerhdf_input_ops = {
+    .set = acerhdf_set_input,
+    .get = acerhdf_get_input,
+};
+
+module_param_cb(input, &acerhdf_input_ops, NULL, 0600);
+MODULE_PARM_DESC(input, "Control input: ec, dts (CPU package sensor), max or fused");
+
+static void __init acerhdf_dts_probe(void) {
+    u64 target;
+
+    if (!boot_cpu_has(X86_FEATURE_PTS) ||
+            rdmsrl_safe(MSR_IA32_TEMPERATURE_TARGET, &target) ||
+            !((target >> 16) & 0xff)) {
+        pr_info("package thermal sensor not available, using the EC\n");
+        return;
+    }
+
+    dts.tjmax = ((target >> 16) & 0xff) * 1000;
+    dts.available = true;
+}
+
+/* package temperature in millidegrees, INT_MIN if there is no reading */
+static int acerhdf_dts_read(void) {
+    u64 status;
+
+    if (!dts.available ||
+            rdmsrl_safe(MSR_IA32_PACKAGE_THERM_STATUS, &status) ||
+            !(status & BIT(31)))
+        return INT_MIN;
+
+    return dts.tjmax - ((status >> 16) & 0x7f) * 1000;
+}
+
+/*
+ * Sensor fusion: a scalar Kalman filter over both sensors. Between samples
+ * the estimate may drift by fusion_process_noise per second, then the DTS
+ * and EC readings pull it towards them by the inverse of their noise. Noise
+ * values are standard deviations in millidegrees, the variance is kept in
+ * millidegrees squared and capped so the products stay within s64.
+ */
+#define ACERHDF_FUSION_MAX_VAR 10000000000LL
+
+struct acerhdf_fusion {
+    bool primed;
+    unsigned long last;
+    s64 x;
+    s64 p;
+};
+
+static unsigned int fusion_process_noise = 1000;
+static unsigned int fusion_dts_noise = 2000;
+static unsigned int fusion_ec_noise = 4000;
+static struct acerhdf_fusion fusion;
+
+static const struct acerhdf_uint_param fusion_noise_param[] = {
+    { &fusion_process_noise, 1, 20000, NULL },
+    { &fusion_dts_noise, 1, 20000, NULL },
+    { &fusion_ec_noise, 1, 20000, NULL },
+};
+
+module_param_cb(fusion_process_noise, &acerhdf_uint_ops,
+        &fusion_noise_param[0], 0600);
+MODULE_PARM_DESC(fusion_process_noise, "Fused estimate drift per second in millidegrees");
+module_param_cb(fusion_dts_noise, &acerhdf_uint_ops, &fusion_noise_param[1],
+        0600);
+MODULE_PARM_DESC(fusion_dts_noise, "Package sensor noise in millidegrees");
+module_param_cb(fusion_ec_noise, &acerhdf_uint_ops, &fusion_noise_param[2],
+        0600);
+MODULE_PARM_DESC(fusion_ec_noise, "EC sensor noise (and lag) in millidegrees");
+
+static void acerhdf_fusion_correct(int z, unsigned int noise) {
+    s64 r = (s64) noise * noise;
+
+    fusion.x += div64_s64((z - fusion.x) * fusion.p, fusion.p + r);
+    fusion.p = div64_s64(fusion.p * r, fusion.p + r);
+}
+
+/* once per sample, ec in degrees, dts in millidegrees or INT_MIN */
+static void acerhdf_fusion_update(int ec, int dts) {
+    s64 q = READ_ONCE(fusion_process_noise);
+    unsigned int dt = 0;
+
+    if (fusion.primed) {
+        dt = min(jiffies_to_msecs(jiffies - fusion.last), 60000U);
+    } else {
+        /* no prior, the first readings decide */
+        fusion.x = (s64) ec * 1000;
+        fusion.p = ACERHDF_FUSION_MAX_VAR;
+        fusion.primed = true;
+    }
+    fusion.last = jiffies;
+
+    fusion.p = min(fusion.p + div_s64(q * q * dt, 1000),
+            ACERHDF_FUSION_MAX_VAR);
+    if (dts != INT_MIN)
+        acerhdf_fusion_correct(dts, READ_ONCE(fusion_dts_noise));
+    acerhdf_fusion_correct(ec * 1000, READ_ONCE(fusion_ec_noise));
+}
+
+/* ec in degrees, dts and the result in millidegrees */
+static int acerhdf_select_input(int ec, int dts) {
+    if (dts == INT_MIN)
+        return ec * 1000;
+
+    switch (READ_ONCE(input)) {
+    case ACERHDF_INPUT_DTS:
+        return dts;
+    case ACERHDF_INPUT_MAX:
+        return max(ec * 1000, dts);
+    case ACERHDF_INPUT_FUSED:
+        return (int) fusion.x;
+    default:
+        return ec * 1000;
+    }
+}
+
+/*
+ * Extra inputs next to the CPU one: EC temperature registers or kernel
+ * thermal zones (pch_cannonlake, iwlwifi, ...), each with an offset in
+ * degrees and a weight in percent. The hottest of them after offset - and
+ * with input_combine=wmax after weighting - becomes the control input.
+ * EC registers are read with the sample. Thermal zones are read from a work
+ * item for the next sample, as our get_temp callback runs under our own
+ * zone's lock. The list comes from the model table or the extra_inputs
+ * parameter.
+ */
+#define ACERHDF_MAX_INPUTS 8
+
+enum acerhdf_combine {
+    ACERHDF_COMBINE_MAX,
+    ACERHDF_COMBINE_WMAX,
+};
+
+static const char * const acerhdf_combine_names[] = {
+    [ACERHDF_COMBINE_MAX] = "max",
+    [ACERHDF_COMBINE_WMAX] = "wmax",
+};
+
+struct acerhdf_extra_input {
+    char name[THERMAL_NAME_LENGTH];
+    int reg;
+    int offset;
+    unsigned int weight;
+    int temp;
+};
+
+struct acerhdf_inputs {
+    unsigned int n;
+    unsigned int gen;
+    int cpu;
+    int winner;
+    bool zones;
+    struct acerhdf_extra_input in[ACERHDF_MAX_INPUTS];
+};
+
+static unsigned int input_combine = ACERHDF_COMBINE_MAX;
+static struct acerhdf_inputs inputs = { .winner = -1 };
+static bool extra_inputs_set;
+static DEFINE_MUTEX(acerhdf_inputs_lock);
+
+static void acerhdf_inputs_work(struct work_struct *work) {
+    char name[THERMAL_NAME_LENGTH];
+    struct thermal_zone_device *tz;
+    unsigned int i, gen;
+    int temp;
+
+    for (i = 0; ; i++) {
+        mutex_lock(&acerhdf_inputs_lock);
+        if (i >= inputs.n) {
+            mutex_unlock(&acerhdf_inputs_lock);
+            break;
+        }
+        if (inputs.in[i].reg >= 0) {
+            mutex_unlock(&acerhdf_inputs_lock);
+            continue;
+        }
+        strscpy(name, inputs.in[i].name, sizeof (name));
+        gen = inputs.gen;
+        mutex_unlock(&acerhdf_inputs_lock);
+
+        /* looked up every time, the zone may come and go with its driver */
+        tz = thermal_zone_get_zone_by_name(name);
+        if (IS_ERR(tz) || thermal_zone_get_temp(tz, &temp))
+            temp = INT_MIN;
+
+        mutex_lock(&acerhdf_inputs_lock);
+        if (gen == inputs.gen)
+            inputs.in[i].temp = temp;
+        mutex_unlock(&acerhdf_inputs_lock);
+    }
+}
+
+static DECLARE_WORK(acerhdf_inputs_update, acerhdf_inputs_work);
+
+/* "source[:offset[:weight]]", source is an EC register (0x..) or a zone */
+static int acerhdf_parse_inputs(const char *val, struct acerhdf_inputs *l) {
+    struct acerhdf_extra_input *e;
+    char *buf, *p, *tok, *field;
+    int err = 0;
+    u8 reg;
+
+    buf = kstrdup(val, GFP_KERNEL);
+    if (!buf)
+        return -ENOMEM;
+
+    p = buf;
+    while ((tok = strsep(&p, ", \t\n"))) {
+        if (!*tok)
+            continue;
+        if (l->n == ACERHDF_MAX_INPUTS) {
+            err = -EINVAL;
+            break;
+        }
+
+        e = &l->in[l->n];
+        e->weight = 100;
+        e->temp = INT_MIN;
+        field = strsep(&tok, ":");
+        if (!*field || strlen(field) >= sizeof (e->name)) {
+            err = -EINVAL;
+            break;
+        }
+        strscpy(e->name, field, sizeof (e->name));
+        e->reg = -1;
+        if (!strncmp(field, "0x", 2)) {
+            if (kstrtou8(field, 16, &reg)) {
+                err = -EINVAL;
+                break;
+            }
+            e->reg = reg;
+        } else {
+            l->zones = true;
+        }
+
+        field = strsep(&tok, ":");
+        if ((field && kstrtoint(field, 10, &e->offset)) ||
+                (tok && kstrtouint(tok, 10, &e->weight)) ||
+                e->offset < -50 || e->offset > 50 ||
+                e->weight < 1 || e->weight > 200) {
+            err = -EINVAL;
+            break;
+        }
+        e->offset *= 1000;
+        l->n++;
+    }
+    kfree(buf);
+
+    return err;
+}
+
+static int acerhdf_load_inputs(const char *val) {
+    struct acerhdf_inputs *l;
+    int err;
+
+    l = kzalloc(sizeof (*l), GFP_KERNEL);
+    if (!l)
+        return -ENOMEM;
+
+    err = acerhdf_parse_inputs(val, l);
+    if (!err) {
+        mutex_lock(&acerhdf_inputs_lock);
+        l->gen = inputs.gen + 1;
+        l->winner = -1;
+        inputs = *l;
+        mutex_unlock(&acerhdf_inputs_lock);
+        if (l->zones)
+            queue_work(system_power_efficient_wq, &acerhdf_inputs_update);
+    }
+    kfree(l);
+
+    return err;
+}
+
+static int acerhdf_set_inputs(const char *val, const struct kernel_param *kp) {
+    int err = acerhdf_load_inputs(val);
+
+    if (!err)
+        extra_inputs_set = true;
+
+    return err;
+}
+
+static int acerhdf_get_inputs(char *buf, const struct kernel_param *kp) {
+    const struct acerhdf_extra_input *e;
+    unsigned int i;
+    int len = 0;
+
+    mutex_lock(&acerhdf_inputs_lock);
+    for (i = 0; i < inputs.n; i++) {
+        e = &inputs.in[i];
+        len += sprintf(buf + len, "%s%s:%d:%u", i ? "," : "", e->name,
+                e->offset / 1000, e->weight);
+    }
+    mutex_unlock(&acerhdf_inputs_lock);
+
+    return len + sprintf(buf + len, "\n");
+}
+
+static const struct kernel_param_ops acerhdf_inputs_ops = {
+    .set = acerhdf_set_inputs,
+    .get = acerhdf_get_inputs,
+};
+
+static int acerhdf_set_combine(const char *val, const struct kernel_param *kp) {
+    int mode = sysfs_match_string(acerhdf_combine_names, val);
+
+    if (mode < 0)
+        return mode;
+
+    WRITE_ONCE(input_combine, mode);
+    return 0;
+}
+
+static int acerhdf_get_combine(char *buf, const struct kernel_param *kp) {
+    return sprintf(buf, "%s\n", acerhdf_combine_names[input_combine]);
+}
+
+static const struct kernel_param_ops acerhdf_combine_ops = {
+    .set = acerhdf_set_combine,
+    .get = acerhdf_get_combine,
+};
+
+module_param_cb(extra_inputs, &acerhdf_inputs_ops, NULL, 0600);
+MODULE_PARM_DESC(extra_inputs, "Extra inputs as source[:offset[:weight]], source an EC register (0x..) or a thermal zone");
+module_param_cb(input_combine, &acerhdf_combine_ops, NULL, 0600);
+MODULE_PARM_DESC(input_combine, "Combine inputs by max or wmax (weighted max)");
+
+/*
+ * cpu is the selected CPU input in millidegrees, so is the result. With
+ * offsets and weights the result is a score rather than a temperature, it
+ * drives the curve or the pid and is reported nowhere else.
+ */
+static int acerhdf_combine_inputs(int cpu) {
+    bool weighted = READ_ONCE(input_combine) == ACERHDF_COMBINE_WMAX;
+    struct acerhdf_extra_input *e;
+    s64 best = (s64) cpu * 100, score;
+    unsigned int i;
+    u8 val;
+
+    mutex_lock(&acerhdf_inputs_lock);
+    inputs.cpu = cpu;
+    inputs.winner = -1;
+    for (i = 0; i < inputs.n; i++) {
+        e = &inputs.in[i];
+        if (e->reg >= 0)
+            e->temp = acerhdf_ec_read(e->reg, &val) ? INT_MIN : val * 1000;
+        if (e->temp == INT_MIN)
+            continue;
+
+        score = (s64) (e->temp + e->offset) * (weighted ? e->weight : 100);
+        if (score > best) {
+            best = score;
+            inputs.winner = i;
+        }
+    }
+    /* thermal zones for the next sample */
+    if (inputs.zones)
+        queue_work(system_power_efficient_wq, &acerhdf_inputs_update);
+    mutex_unlock(&acerhdf_inputs_lock);
+
+    return div_s64(best, 100);
+}
+
+/* how long a cached EC sample counts as the current cycle's one */
+static unsigned long acerhdf_sample_max_age(void) {
+    unsigned long age = msecs_to_jiffies(READ_ONCE(poll_delay_ms)) / 2;
+
+    return clamp_t(unsigned long, age, 1, ACERHDF_SAMPLE_MAX_AGE);
+}
+
+/*
+ * copy of the current sample, the sensors are read only if the cached one is
+ * older than max_age
+ */
+static int acerhdf_sample_get(struct acerhdf_sample *s,
+        unsigned long max_age) {
+    unsigned int budget_us = READ_ONCE(ec_budget_us);
+    int err = 0;
+
+    acerhdf_ec_batch_begin();
+    mutex_lock(&acerhdf_sample_lock);
+    if (!ec_sample.valid ||
+            time_after(jiffies, ec_sample.stamp + max_age)) {
+        /* without a good sample to fall back to, wait for the EC */
+        if (budget_us && ec_sample.valid) {
+            err = acerhdf_read_ec_temp_bounded(&ec_sample.temp, budget_us);
+            if (err == -ETIMEDOUT) {
+                stats.ec_budget_overruns++;
+                if (!time_after(jiffies, ec_sample.stamp +
+                        ACERHDF_SAMPLE_REUSE_POLLS *
+                        msecs_to_jiffies(READ_ONCE(poll_delay_ms)))) {
+                    err = 0;
+                    goto reuse;
+                }
+            }
+        } else {
+            err = acerhdf_read_ec_temp(&ec_sample.temp);
+        }
+        if (err) {
+            ec_sample.valid = false;
+            goto out;
+        }
+        ec_sample.dts = acerhdf_dts_read();
+        acerhdf_fusion_update(ec_sample.temp, ec_sample.dts);
+        ec_sample.input = acerhdf_combine_inputs(
+                acerhdf_select_input(ec_sample.temp, ec_sample.dts));
+        ec_sample.stamp = jiffies;
+        ec_sample.time = ktime_get();
+        ec_sample.seq++;
+        ec_sample.valid = true;
+    }
+reuse:
+    *s = ec_sample;
+out:
+    mutex_unlock(&acerhdf_sample_lock);
+    acerhdf_ec_batch_end();
+    return err;
+}
+
+/*
+ * control input of the current poll cycle in millidegrees, ec gets the EC
+ * reading of the same sample
+ */
+static int acerhdf_get_temp(int *temp, int *ec, unsigned int *seq) {
+    struct acerhdf_sample s;
+    int err;
+
+    err = acerhdf_sample_get(&s, acerhdf_sample_max_age());
+    if (err)
+        return err;
+
+    *temp = s.input;
+    if (ec)
+        *ec = s.temp * 1000;
+    if (seq)
+        *seq = s.seq;
+    return 0;
+}
+
+/*
+ * EC temperature in millidegrees. The thermal zone reports this one whatever
+ * the control input is: the critical trip and the orderly poweroff behind it
+ * are tuned for the lagging EC reading, a package sensor spike must not
+ * trip them.
+ */
+static int acerhdf_get_zone_temp(int *temp) {
+    struct acerhdf_sample s;
+    int err;
+
+    err = acerhdf_sample_get(&s, acerhdf_sample_max_age());
+    if (err)
+        return err;
+
+    *temp = s.temp * 1000;
+    return 0;
+}
+
+/*
+ * Temperature filters, see acerhdf_ctl.h, selected at runtime through the
+ * filter module parameter. temp_filter and gpu_filter are guarded by
+ * acerhdf_filter_lock.
+ */
+static unsigned int filter_type = ACERHDF_FILTER_BOX;
+static unsigned int filter_window = TEMPERATURE_SAMPLES;
+static unsigned int filter_alpha = 64;
+static unsigned int filter_span = TEMPERATURE_SAMPLES * 1000;
+static struct acerhdf_filter temp_filter;
+static struct acerhdf_filter gpu_filter;
+static DEFINE_MUTEX(acerhdf_filter_lock);
+
+/* the filter tunables as they are now, acerhdf_filter_lock held */
+static void acerhdf_filter_cfg(struct acerhdf_filter_cfg *cfg) {
+    cfg->window = filter_window;
+    cfg->alpha = filter_alpha;
+    cfg->span = filter_span;
+    cfg->period = acerhdf_config_get(interval) * 1000;
+}
+
+/* start the filter from sample seq instead of from nothing */
+static void acerhdf_filter_prefill(int temp, unsigned int seq) {
+    struct acerhdf_filter *f = &temp_filter;
+    struct acerhdf_filter_cfg cfg;
+
+    mutex_lock(&acerhdf_filter_lock);
+    acerhdf_filter_cfg(&cfg);
+    acerhdf_filter_reset(f);
+    acerhdf_filters[filter_type].prefill(f, &cfg, temp,
+            jiffies_to_msecs(jiffies));
+    f->seq = seq;
+    f->out = temp;
+    mutex_unlock(&acerhdf_filter_lock);
+}
+
+/* feed a new sample (identified by seq) and return the filtered value */
+static int acerhdf_filter_temp(struct acerhdf_filter *f, int temp,
+        unsigned int seq) {
+    struct acerhdf_filter_cfg cfg;
+    int out;
+
+    mutex_lock(&acerhdf_filter_lock);
+    acerhdf_filter_cfg(&cfg);
+    if (seq != f->seq) {
+        f->seq = seq;
+        f->out = acerhdf_filters[filter_type].update(f, &cfg, temp,
+                jiffies_to_msecs(jiffies));
+    }
+    out = f->out;
+    mutex_unlock(&acerhdf_filter_lock);
+
+    return out;
+}
+
+static int acerhdf_set_filter(const char *val, const struct kernel_param *kp) {
+    unsigned int i;
+
+    for (i = 0; i < ARRAY_SIZE(acerhdf_filters); i++) {
+        if (sysfs_streq(val, acerhdf_filters[i].name))
+            break;
+    }
+    if (i == ARRAY_SIZE(acerhdf_filters))
+        return -EINVAL;
+
+    mutex_lock(&acerhdf_filter_lock);
+    if (filter_type != i) {
+        filter_type = i;
+        acerhdf_filter_reset(&temp_filter);
+        acerhdf_filter_reset(&gpu_filter);
+    }
+    mutex_unlock(&acerhdf_filter_lock);
+
+    return 0;
+}
+
+static int acerhdf_get_filter(char *buf, const struct kernel_param *kp) {
+    return sprintf(buf, "%s\n", acerhdf_filters[filter_type].name);
+}
+
+static const struct kernel_param_ops acerhdf_filter_param_ops = {
+    .set = acerhdf_set_filter,
+    .get = acerhdf_get_filter,
+};
+
+/* a new window or weight invalidates what the filter accumulated so far */
+static void acerhdf_filter_apply(unsigned int *val, unsigned int v) {
+    mutex_lock(&acerhdf_filter_lock);
+    if (*val != v) {
+        *val = v;
+        acerhdf_filter_reset(&temp_filter);
+        acerhdf_filter_reset(&gpu_filter);
+    }
+    mutex_unlock(&acerhdf_filter_lock);
+}
+
+static const struct acerhdf_uint_param filter_window_param = {
+    &filter_window, 1, ACERHDF_FILTER_MAX_WINDOW, acerhdf_filter_apply
+};
+static const struct acerhdf_uint_param filter_alpha_param = {
+    &filter_alpha, 1, 256, acerhdf_filter_apply
+};
+static const struct acerhdf_uint_param filter_span_param = {
+    &filter_span, 100, 60000, acerhdf_filter_apply
+};
+
+module_param_cb(filter, &acerhdf_filter_param_ops, NULL, 0600);
+MODULE_PARM_DESC(filter, "Temperature filter: box, ema, median or twa");
+module_param_cb(filter_window, &acerhdf_uint_ops,
+        &filter_window_param, 0600);
+MODULE_PARM_DESC(filter_window, "Samples averaged by the box and median filters (1-32)");
+module_param_cb(filter_alpha, &acerhdf_uint_ops,
+        &filter_alpha_param, 0600);
+MODULE_PARM_DESC(filter_alpha, "Weight of a new sample in the ema filter, n/256 (1-256)");
+module_param_cb(filter_span, &acerhdf_uint_ops,
+        &filter_span_param, 0600);
+MODULE_PARM_DESC(filter_span, "Time window of the twa filter in ms (100-60000)");
+
+/* fan curves, see acerhdf_ctl.h, published with an RCU pointer swap */
+static struct acerhdf_curve __rcu *fan_curve;
+static DEFINE_MUTEX(acerhdf_curve_lock);
+
+static int acerhdf_load_curve(struct acerhdf_curve __rcu **slot,
+        const char *val) {
+    struct acerhdf_curve *c, *old;
+    int err;
+
+    c = kzalloc(sizeof (*c), GFP_KERNEL);
+    if (!c)
+        return -ENOMEM;
+
+    err = acerhdf_parse_curve(val, c);
+    if (err) {
+        kfree(c);
+        return err;
+    }
+    acerhdf_compile_curve(c);
+
+    mutex_lock(&acerhdf_curve_lock);
+    old = rcu_dereference_protected(*slot,
+            lockdep_is_held(&acerhdf_curve_lock));
+    rcu_assign_pointer(*slot, c);
+    mutex_unlock(&acerhdf_curve_lock);
+
+    if (old)
+        kfree_rcu(old, rcu);
+
+    return 0;
+}
+
+static void acerhdf_free_curve(struct acerhdf_curve __rcu **slot) {
+    struct acerhdf_curve *c;
+
+    mutex_lock(&acerhdf_curve_lock);
+    c = rcu_dereference_protected(*slot,
+            lockdep_is_held(&acerhdf_curve_lock));
+    RCU_INIT_POINTER(*slot, NULL);
+    mutex_unlock(&acerhdf_curve_lock);
+
+    /* a parameter read may still be looking at it */
+    if (c)
+        kfree_rcu(c, rcu);
+}
+
+static int acerhdf_curve_state(struct acerhdf_curve __rcu **slot, int input,
+        int *cur) {
+    int state;
+
+    rcu_read_lock();
+    state = acerhdf_curve_lookup(rcu_dereference(*slot), input, cur);
+    rcu_read_unlock();
+
+    return state;
+}
+
+/* degrees to the next fan curve step in the direction of rising or falling */
+static int acerhdf_curve_margin(int temp, bool rising) {
+    const struct acerhdf_curve *c;
+    int margin;
+
+    temp = clamp_t(int, temp, 0, U8_MAX);
+
+    rcu_read_lock();
+    c = rcu_dereference(fan_curve);
+    margin = rising ? c->rise[temp] : c->fall[temp];
+    rcu_read_unlock();
+
+    return margin;
+}
+
+static int acerhdf_set_curve(const char *val, const struct kernel_param *kp) {
+    return acerhdf_load_curve(kp->arg, val);
+}
+
+static int acerhdf_get_curve(char *buf, const struct kernel_param *kp) {
+    const struct acerhdf_curve *c;
+    unsigned int i;
+    int len = 0;
+
+    rcu_read_lock();
+    c = rcu_dereference(*(struct acerhdf_curve __rcu **) kp->arg);
+    for (i = 0; c && i < c->npoints; i++) {
+        len += sprintf(buf + len, "%s%u:%u", i ? "," : "",
+                c->input[i], c->state[i]);
+        if (c->hyst[i])
+            len += sprintf(buf + len, ":%u", c->hyst[i]);
+    }
+    rcu_read_unlock();
+
+    return len + sprintf(buf + len, "\n");
+}
+
+static const struct kernel_param_ops acerhdf_curve_param_ops = {
+    .set = acerhdf_set_curve,
+    .get = acerhdf_get_curve,
+};
+
+module_param_cb(curve, &acerhdf_curve_param_ops, &fan_curve, 0600);
+MODULE_PARM_DESC(curve, "Fan curve as temp:state[:hyst] points, e.g. \"" ACERHDF_DEFAULT_CURVE "\"");
+
+/*
+ * State transitions of the controller output, counted per minute so curve
+ * oscillation around a step shows up
+ */
+struct acerhdf_transitions {
+    int last;
+    unsigned long window;
+    unsigned int count;
+    unsigned int per_min;
+};
+
+static int curve_out = -1;
+static int power_out = -1;
+static struct acerhdf_transitions transitions = { .last = -1 };
+
+static void acerhdf_count_transition(int state) {
+    unsigned long elapsed = jiffies - transitions.window;
+
+    if (transitions.last >= 0 && state != transitions.last) {
+        stats.transitions++;
+        transitions.count++;
+    }
+    transitions.last = state;
+
+    if (elapsed >= 60 * HZ) {
+        transitions.per_min = transitions.count * 60 * HZ / elapsed;
+        transitions.count = 0;
+        transitions.window = jiffies;
+    }
+}
+
+/*
+ * Package power feed-forward. The EC temperature lags the package by seconds,
+ * so with power_ff set the average package power since the previous sample,
+ * taken from the RAPL energy counter, is mapped through power_curve and may
+ * raise the fan state before the temperature curve does.
+ */
+struct acerhdf_rapl {
+    bool available;
+    bool primed;
+    unsigned int esu;
+    unsigned int seq;
+    u32 last_energy;
+    ktime_t last;
+    int power_mw;
+};
+
+static bool power_ff;
+static struct acerhdf_curve __rcu *power_curve;
+static struct acerhdf_rapl rapl = { .power_mw = -1 };
+
+module_param(power_ff, bool, 0600);
+MODULE_PARM_DESC(power_ff, "Raise the fan state from package power ahead of temperature");
+module_param_cb(power_curve, &acerhdf_curve_param_ops, &power_curve, 0600);
+MODULE_PARM_DESC(power_curve, "Feed-forward curve as watts:state points, e.g. \"" ACERHDF_DEFAULT_POWER_CURVE "\"");
+
+static void __init acerhdf_rapl_probe(void) {
+    u64 unit;
+
+    if (rdmsrl_safe(MSR_RAPL_POWER_UNIT, &unit)) {
+        pr_info("RAPL not available, power feed-forward disabled\n");
+        return;
+    }
+
+    /* energy status unit, the counter counts in 1/2^esu J */
+    rapl.esu = (unit >> 8) & 0x1f;
+    rapl.available = true;
+}
+
+/* average package power in mW over the cycle ending with sample seq */
+static int acerhdf_rapl_power(unsigned int seq) {
+    u64 raw, uj;
+    s64 us;
+    ktime_t now;
+
+    if (!rapl.available || seq == rapl.seq)
+        return rapl.power_mw;
+    rapl.seq = seq;
+
+    if (rdmsrl_safe(MSR_PKG_ENERGY_STATUS, &raw)) {
+        rapl.power_mw = -1;
+        rapl.primed = false;
+        return -1;
+    }
+    now = ktime_get();
+
+    if (rapl.primed) {
+        us = ktime_us_delta(now, rapl.last);
+        uj = ((u64) ((u32) raw - rapl.last_energy) * USEC_PER_SEC) >>
+                rapl.esu;
+        if (us > 0)
+            rapl.power_mw = div64_u64(uj * 1000, us);
+    }
+    rapl.primed = true;
+    rapl.last_energy = (u32) raw;
+    rapl.last = now;
+
+    return rapl.power_mw;
+}
+
+/* output shaping, see acerhdf_ctl.h */
+static unsigned int ramp_up = ACERHDF_DEFAULT_RAMP_UP;
+static unsigned int ramp_down = ACERHDF_DEFAULT_RAMP_DOWN;
+static unsigned int down_dwell_ms = ACERHDF_DEFAULT_DOWN_DWELL_MS;
+static struct acerhdf_shape shape = { .out = -1 };
+
+static const struct acerhdf_uint_param ramp_param[] = {
+    { &ramp_up, 0, ACERHDF_MAX_STATE, NULL },
+    { &ramp_down, 0, ACERHDF_MAX_STATE, NULL },
+};
+static const struct acerhdf_uint_param down_dwell_ms_param = {
+    &down_dwell_ms, 0, 600000, NULL
+};
+
+module_param_cb(ramp_up, &acerhdf_uint_ops, &ramp_param[0], 0600);
+MODULE_PARM_DESC(ramp_up, "Fan states per second the fan may speed up, 0 = immediately");
+module_param_cb(ramp_down, &acerhdf_uint_ops, &ramp_param[1], 0600);
+MODULE_PARM_DESC(ramp_down, "Fan states per second the fan may slow down, 0 = immediately");
+module_param_cb(down_dwell_ms, &acerhdf_uint_ops, &down_dwell_ms_param, 0600);
+MODULE_PARM_DESC(down_dwell_ms, "Minimum time in a fan state before stepping down, ms");
+
+static int acerhdf_shape_state(int target) {
+    struct acerhdf_shape_cfg cfg;
+
+    cfg.ramp_up = READ_ONCE(ramp_up);
+    cfg.ramp_down = READ_ONCE(ramp_down);
+    cfg.down_dwell_ms = READ_ONCE(down_dwell_ms);
+
+    return acerhdf_shape_step(&shape, &cfg, target,
+            jiffies_to_msecs(jiffies));
+}
+
+/*
+ * Emergency bypass, see acerhdf_ctl.h. Entries and the time from the sample
+ * to the boost being written are accounted here.
+ */
+struct acerhdf_emergency {
+    struct acerhdf_emergency_ctl ctl;
+    unsigned int seq;
+    bool entered;
+    unsigned long entries;
+    s64 latency_us;
+    s64 max_latency_us;
+};
+
+static unsigned int emergency_temp = ACERHDF_DEFAULT_EMERGENCY_TEMP;
+static unsigned int emergency_rate = ACERHDF_DEFAULT_EMERGENCY_RATE;
+static struct acerhdf_emergency emergency;
+
+static const struct acerhdf_uint_param emergency_temp_param = {
+    &emergency_temp, 40, ACERHDF_TEMP_CRIT, NULL
+};
+static const struct acerhdf_uint_param emergency_rate_param = {
+    &emergency_rate, 0, 100, NULL
+};
+
+module_param_cb(emergency_temp, &acerhdf_uint_ops, &emergency_temp_param,
+        0600);
+MODULE_PARM_DESC(emergency_temp, "Go to full fan at once from this EC temperature");
+module_param_cb(emergency_rate, &acerhdf_uint_ops, &emergency_rate_param,
+        0600);
+MODULE_PARM_DESC(emergency_rate, "Go to full fan at once on an EC rise of this many degrees per second, 0 = off");
+
+/*
+ * temperatures in millidegrees, ec is the EC reading, filtered the filtered
+ * control input; returns true while boosted
+ */
+static bool acerhdf_emergency_check(unsigned int seq, int ec, int filtered) {
+    struct acerhdf_emergency_cfg cfg;
+    bool was = emergency.ctl.boosted;
+
+    emergency.entered = false;
+    if (seq == emergency.seq)
+        return was;
+    emergency.seq = seq;
+
+    cfg.temp = READ_ONCE(emergency_temp);
+    cfg.rate = READ_ONCE(emergency_rate);
+    if (acerhdf_emergency_update(&emergency.ctl, &cfg, ec, filtered,
+            jiffies_to_msecs(jiffies)) == was)
+        return was;
+
+    if (!was) {
+        emergency.entered = true;
+        emergency.entries++;
+    }
+    acerhdf_notify("emergency");
+
+    return !was;
+}
+
+/* the boost is written, account for how long that took since the sample */
+static void acerhdf_emergency_done(void) {
+    if (!emergency.entered)
+        return;
+
+    emergency.latency_us = ktime_us_delta(ktime_get(), ec_sample.time);
+    emergency.max_latency_us = max(emergency.max_latency_us,
+            emergency.latency_us);
+    pr_notice_ratelimited("emergency: %d C, full fan after %lld us\n",
+            ec_sample.temp, emergency.latency_us);
+}
+
+/*
+ * Closed-loop setpoint mode. Instead of the curve, an integer PID holds the
+ * filtered temperature at pid_setpoint. Everything is fixed point: the error
+ * is in millidegrees, the output and the P/I/D terms in millistates, gains
+ * are millistates per degree (kp), per degree and second (ki) and per degree
+ * per second (kd). The integrator is only advanced while the output is not
+ * saturated in the direction of the error (anti-windup), the derivative is
+ * taken on the measurement so setpoint changes don't kick the fan.
+ */
+enum acerhdf_control_mode {
+    ACERHDF_MODE_CURVE,
+    ACERHDF_MODE_PID,
+};
+
+static const char * const acerhdf_mode_names[] = {
+    [ACERHDF_MODE_CURVE] = "curve",
+    [ACERHDF_MODE_PID] = "pid",
+};
+
+struct acerhdf_pid {
+    unsigned int seq;
+    bool primed;
+    unsigned long last;
+    int last_temp;
+    s64 integral;
+    int p;
+    int i;
+    int d;
+    int out;
+};
+
+static unsigned int control_mode = ACERHDF_MODE_CURVE;
+static unsigned int pid_setpoint = 75;
+static unsigned int pid_kp = 500;
+static unsigned int pid_ki = 20;
+static unsigned int pid_kd;
+static struct acerhdf_pid pid;
+
+static void acerhdf_pid_reset(void) {
+    memset(&pid, 0, sizeof (pid));
+}
+
+/* temp is the filtered temperature in millidegrees, returns a fan state */
+static int acerhdf_pid_step(unsigned int seq, int temp) {
+    const int lo = MIN_FAN_SPEED * 1000, hi = ACERHDF_MAX_STATE * 1000;
+    int err = temp - (int) pid_setpoint * 1000;
+    unsigned int dt = 0;
+    s64 integral, out;
+
+    if (seq == pid.seq)
+        goto out;
+    pid.seq = seq;
+
+    if (pid.primed)
+        dt = jiffies_to_msecs(jiffies - pid.last);
+    pid.primed = true;
+    pid.last = jiffies;
+
+    pid.p = div_s64((s64) pid_kp * err, 1000);
+
+    /* m°C ms, so ki * integral / 10^6 are millistates */
+    integral = pid.integral + (s64) err * dt;
+    pid.i = div_s64((s64) pid_ki * integral, 1000000);
+
+    pid.d = 0;
+    if (dt)
+        pid.d = div_s64((s64) pid_kd * (temp - pid.last_temp), dt);
+    pid.last_temp = temp;
+
+    out = (s64) pid.p + pid.i + pid.d;
+    if ((out > hi && err > 0) || (out < lo && err < 0)) {
+        /* saturated, keep the integrator where it was */
+        pid.i = div_s64((s64) pid_ki * pid.integral, 1000000);
+        out = (s64) pid.p + pid.i + pid.d;
+    } else {
+        pid.integral = integral;
+    }
+    pid.out = clamp_t(s64, out, lo, hi);
+
+out:
+    return DIV_ROUND_CLOSEST(pid.out, 1000);
+}
+
+static int acerhdf_set_control_mode(const char *val,
+        const struct kernel_param *kp) {
+    int mode = sysfs_match_string(acerhdf_mode_names, val);
+
+    if (mode < 0)
+        return mode;
+
+    WRITE_ONCE(control_mode, mode);
+    return 0;
+}
+
+static int acerhdf_get_control_mode(char *buf, const struct kernel_param *kp) {
+    return sprintf(buf, "%s\n", acerhdf_mode_names[control_mode]);
+}
+
+static const struct kernel_param_ops acerhdf_control_mode_ops = {
+    .set = acerhdf_set_control_mode,
+    .get = acerhdf_get_control_mode,
+};
+
+static const struct acerhdf_uint_param pid_setpoint_param = {
+    &pid_setpoint, 30, ACERHDF_TEMP_CRIT - 1, NULL
+};
+static const struct acerhdf_uint_param pid_gain_param[] = {
+    { &pid_kp, 0, 100000, NULL },
+    { &pid_ki, 0, 100000, NULL },
+    { &pid_kd, 0, 100000, NULL },
+};
+
+module_param_cb(control_mode, &acerhdf_control_mode_ops, NULL, 0600);
+MODULE_PARM_DESC(control_mode, "Fan control: curve or pid (setpoint)");
+module_param_cb(pid_setpoint, &acerhdf_uint_ops, &pid_setpoint_param, 0600);
+MODULE_PARM_DESC(pid_setpoint, "Target temperature of the pid mode");
+module_param_cb(pid_kp, &acerhdf_uint_ops, &pid_gain_param[0], 0600);
+MODULE_PARM_DESC(pid_kp, "Proportional gain, millistates per degree");
+module_param_cb(pid_ki, &acerhdf_uint_ops, &pid_gain_param[1], 0600);
+MODULE_PARM_DESC(pid_ki, "Integral gain, millistates per degree second");
+module_param_cb(pid_kd, &acerhdf_uint_ops, &pid_gain_param[2], 0600);
+MODULE_PARM_DESC(pid_kd, "Derivative gain, millistates per degree/second");
+
+/*
+ * Optional driver-owned control loop. With control_period_ms set, an hrtimer
+ * kicks a work item every period which runs the thermal zone update, the
+ * thermal core's own polling is switched off meanwhile. The lateness of each
+ * run against its timer expiry goes into a log2 histogram.
+ */
+#define ACERHDF_JITTER_BUCKETS 16
+
+struct acerhdf_control {
+    struct hrtimer timer;
+    struct work_struct work;
+    bool running;
+    ktime_t expected;
+    ktime_t last;
+    u64 runs;
+    u64 missed;
+    s64 interval_us;
+    s64 min_us;
+    s64 max_us;
+    s64 sum_us;
+    unsigned long jitter[ACERHDF_JITTER_BUCKETS];
+};
+
+static unsigned int control_period_ms;
+static struct acerhdf_control control;
+static DEFINE_MUTEX(acerhdf_control_lock);
+
+static enum hrtimer_restart acerhdf_control_timer(struct hrtimer *timer) {
+    control.expected = hrtimer_get_expires(timer);
+    if (!queue_work(system_highpri_wq, &control.work))
+        control.missed++;
+
+    hrtimer_forward_now(timer, ms_to_ktime(READ_ONCE(control_period_ms)));
+    return HRTIMER_RESTART;
+}
+
+static void acerhdf_control_work(struct work_struct *work) {
+    ktime_t now = ktime_get();
+    s64 late = ktime_us_delta(now, control.expected);
+    s64 delta;
+
+    if (!READ_ONCE(control.running) || !thz_dev)
+        return;
+
+    if (control.runs) {
+        delta = ktime_us_delta(now, control.last);
+        control.interval_us = delta;
+        control.min_us = min(control.min_us, delta);
+        control.max_us = max(control.max_us, delta);
+        control.sum_us += delta;
+    }
+    control.last = now;
+    control.runs++;
+    control.jitter[min_t(int, late > 0 ? fls64(late) : 0,
+            ACERHDF_JITTER_BUCKETS - 1)]++;
+
+    thermal_zone_device_update(thz_dev, THERMAL_EVENT_UNSPECIFIED);
+}
+
+/* take over polling from the thermal core, or hand it back */
+static void acerhdf_control_start(void) {
+    mutex_lock(&acerhdf_control_lock);
+    if (control_period_ms && thz_dev && !control.running) {
+        control.runs = 0;
+        control.min_us = S64_MAX;
+        control.max_us = 0;
+        control.sum_us = 0;
+        WRITE_ONCE(control.running, true);
+        thz_dev->polling_delay = 0;
+        poll_delay_ms = control_period_ms;
+        hrtimer_start(&control.timer, ms_to_ktime(control_period_ms),
+                HRTIMER_MODE_REL);
+    }
+    mutex_unlock(&acerhdf_control_lock);
+}
+
+static void acerhdf_control_stop(void) {
+    mutex_lock(&acerhdf_control_lock);
+    if (control.running) {
+        WRITE_ONCE(control.running, false);
+        hrtimer_cancel(&control.timer);
+    }
+    mutex_unlock(&acerhdf_control_lock);
+}
+
+static void acerhdf_control_apply(unsigned int *val, unsigned int v) {
+    acerhdf_control_stop();
+    WRITE_ONCE(*val, v);
+    if (!kernelmode || !thz_dev)
+        return;
+
+    if (v) {
+        acerhdf_control_start();
+    } else {
+        thz_dev->polling_delay = acerhdf_config_get(interval) * 1000;
+        thermal_zone_device_update(thz_dev, THERMAL_EVENT_UNSPECIFIED);
+    }
+}
+
+static const struct acerhdf_uint_param control_period_ms_param = {
+    &control_period_ms, 50, 1000, acerhdf_control_apply
+};
+
+/* 0 switches the loop off, otherwise shorter than 50 ms would flood the EC */
+static int acerhdf_set_control_period(const char *val,
+        const struct kernel_param *kp) {
+    unsigned int v;
+
+    if (!kstrtouint(val, 0, &v) && !v) {
+        acerhdf_control_apply(&control_period_ms, 0);
+        return 0;
+    }
+
+    return acerhdf_set_uint(val, kp);
+}
+
+static const struct kernel_param_ops acerhdf_control_period_ops = {
+    .set = acerhdf_set_control_period,
+    .get = acerhdf_get_uint,
+};
+
+module_param_cb(control_period_ms, &acerhdf_control_period_ops,
+        &control_period_ms_param, 0600);
+MODULE_PARM_DESC(control_period_ms, "Driver-owned control loop period in ms (50-1000), 0 = thermal core polling");
+
+/*
+ * Adaptive polling: poll up to poll_max_ms apart while the temperature is
+ * flat or moves away from the curve steps, tighten down to poll_min_ms when
+ * it heads for a step within adaptive_margin degrees. Otherwise poll twice
+ * per predicted time to reach the step ahead.
+ *
+ * The thermal core queues its polling work on the freezable power efficient
+ * workqueue and rounds delays above one second to whole seconds, so the slow
+ * path coalesces with other wakeups.
+ */
+static bool adaptive;
+static unsigned int poll_min_ms = 250;
+static unsigned int poll_max_ms = 8000;
+static unsigned int adaptive_margin = 2;
+
+struct acerhdf_poll {
+    unsigned int seq;
+    bool primed;
+    unsigned long last;
+    int last_temp;
+    int slope;
+    unsigned long window;
+    unsigned int count;
+    unsigned int per_min;
+};
+
+static struct acerhdf_poll poll;
+
+static const struct acerhdf_uint_param poll_min_ms_param = {
+    &poll_min_ms, 100, 1000, NULL
+};
+static const struct acerhdf_uint_param poll_max_ms_param = {
+    &poll_max_ms, 1000, (ACERHDF_MAX_INTERVAL - 1) * 1000, NULL
+};
+static const struct acerhdf_uint_param adaptive_margin_param = {
+    &adaptive_margin, 0, 20, NULL
+};
+
+/* fixed polling at the configured interval, unless something else owns it */
+static void acerhdf_apply_interval(void) {
+    unsigned int ms;
+
+    if (!thz_dev || !kernelmode || adaptive || READ_ONCE(control.running))
+        return;
+
+    ms = acerhdf_config_get(interval) * 1000;
+    if (acerhdf_verbose())
+        pr_notice("interval changed to: %u\n", ms / 1000);
+    WRITE_ONCE(poll_delay_ms, ms);
+    thz_dev->polling_delay = ms;
+    thermal_zone_device_update(thz_dev, THERMAL_EVENT_UNSPECIFIED);
+}
+
+/*
+ * interval, fanon, fanoff and fan_refresh: validate, copy the current
+ * snapshot with the new value and publish it. At runtime fanoff may not
+ * exceed fanon, so raise fanon first and lower it last. Load-time values
+ * come in any order and are checked as a pair in acerhdf_check_config().
+ */
+static int acerhdf_set_config(const char *val, const struct kernel_param *kp) {
+    size_t offset = (size_t) kp->arg;
+    struct acerhdf_config *c, *old;
+    unsigned int v;
+    int err;
+
+    err = kstrtouint(val, 0, &v);
+    if (err)
+        return err;
+
+    c = kmalloc(sizeof (*c), GFP_KERNEL);
+    if (!c)
+        return -ENOMEM;
+
+    mutex_lock(&acerhdf_config_lock);
+    old = rcu_dereference_protected(cur_config,
+            lockdep_is_held(&acerhdf_config_lock));
+    *c = *old;
+    *(unsigned int *) ((char *) c + offset) = v;
+
+    if (c->interval < 1 || c->interval > ACERHDF_MAX_INTERVAL ||
+            c->fanon > ACERHDF_MAX_FANON ||
+            c->fan_refresh > ACERHDF_MAX_FAN_REFRESH ||
+            (config_checked && c->fanoff > c->fanon)) {
+        mutex_unlock(&acerhdf_config_lock);
+        kfree(c);
+        return -EINVAL;
+    }
+
+    rcu_assign_pointer(cur_config, c);
+    mutex_unlock(&acerhdf_config_lock);
+
+    if (old != &acerhdf_default_config)
+        kfree_rcu(old, rcu);
+
+    if (offset == offsetof(struct acerhdf_config, interval))
+        acerhdf_apply_interval();
+
+    return 0;
+}
+
+static int acerhdf_get_config(char *buf, const struct kernel_param *kp) {
+    size_t offset = (size_t) kp->arg;
+    unsigned int v;
+
+    rcu_read_lock();
+    v = *(unsigned int *) ((char *) rcu_dereference(cur_config) + offset);
+    rcu_read_unlock();
+
+    return sprintf(buf, "%u\n", v);
+}
+
+/*
+ * the load-time values are all in: as the original driver did, clamp a
+ * fanoff above fanon instead of failing the load. Nothing reads the
+ * snapshot yet.
+ */
+static void __init acerhdf_check_config(void) {
+    struct acerhdf_config *c;
+
+    mutex_lock(&acerhdf_config_lock);
+    c = rcu_dereference_protected(cur_config,
+            lockdep_is_held(&acerhdf_config_lock));
+    if (c->fanoff > c->fanon) {
+        pr_err("fanoff temperature (%u) is above fanon temperature (%u), clamping to %u\n",
+                c->fanoff, c->fanon, c->fanon);
+        WRITE_ONCE(c->fanoff, c->fanon);
+    }
+    config_checked = true;
+    mutex_unlock(&acerhdf_config_lock);
+}
+
+static void acerhdf_free_config(void) {
+    struct acerhdf_config *c;
+
+    mutex_lock(&acerhdf_config_lock);
+    c = rcu_dereference_protected(cur_config,
+            lockdep_is_held(&acerhdf_config_lock));
+    RCU_INIT_POINTER(cur_config, &acerhdf_default_config);
+    mutex_unlock(&acerhdf_config_lock);
+
+    if (c != &acerhdf_default_config)
+        kfree_rcu(c, rcu);
+}
+
+static const struct kernel_param_ops acerhdf_config_ops = {
+    .set = acerhdf_set_config,
+    .get = acerhdf_get_config,
+};
+
+module_param_cb(interval, &acerhdf_config_ops,
+        (void *) offsetof(struct acerhdf_config, interval), 0600);
+MODULE_PARM_DESC(interval, "Polling interval of temperature check (1-15 s)");
+module_param_cb(fanon, &acerhdf_config_ops,
+        (void *) offsetof(struct acerhdf_config, fanon), 0600);
+MODULE_PARM_DESC(fanon, "Turn the fan on above this temperature (max 80)");
+module_param_cb(fanoff, &acerhdf_config_ops,
+        (void *) offsetof(struct acerhdf_config, fanoff), 0600);
+MODULE_PARM_DESC(fanoff, "Turn the fan off below this temperature (max fanon)");
+module_param_cb(fan_refresh, &acerhdf_config_ops,
+        (void *) offsetof(struct acerhdf_config, fan_refresh), 0600);
+MODULE_PARM_DESC(fan_refresh, "Rewrite an unchanged fan state every N seconds (0 = never, max 3600)");
+
+/* back to the fixed interval as soon as adaptive polling is switched off */
+static int acerhdf_set_adaptive(const char *val, const struct kernel_param *kp) {
+    int err;
+
+    err = param_set_bool(val, kp);
+    if (!err && !adaptive)
+        acerhdf_apply_interval();
+
+    return err;
+}
+
+static const struct kernel_param_ops acerhdf_adaptive_ops = {
+    .set = acerhdf_set_adaptive,
+    .get = param_get_bool,
+};
+
+module_param_cb(adaptive, &acerhdf_adaptive_ops, &adaptive, 0600);
+MODULE_PARM_DESC(adaptive, "Adapt the polling interval to the temperature slope");
+module_param_cb(poll_min_ms, &acerhdf_uint_ops, &poll_min_ms_param, 0600);
+MODULE_PARM_DESC(poll_min_ms, "Shortest adaptive polling interval in ms (100-1000)");
+module_param_cb(poll_max_ms, &acerhdf_uint_ops, &poll_max_ms_param, 0600);
+MODULE_PARM_DESC(poll_max_ms, "Longest adaptive polling interval in ms (1000-14000)");
+module_param_cb(adaptive_margin, &acerhdf_uint_ops, &adaptive_margin_param,
+        0600);
+MODULE_PARM_DESC(adaptive_margin, "Poll fastest within this many degrees of a curve step");
+
+/* temp is the raw sample in millidegrees, filtered in degrees */
+static unsigned int acerhdf_next_poll_delay(int temp, int filtered) {
+    unsigned int lo = min(poll_min_ms, poll_max_ms);
+    unsigned int dt = jiffies_to_msecs(jiffies - poll.last);
+    int margin;
+    s64 reach;
+
+    if (poll.primed && dt)
+        poll.slope = (poll.slope + (temp - poll.last_temp) * 1000 / (int) dt) / 2;
+    poll.primed = true;
+    poll.last = jiffies;
+    poll.last_temp = temp;
+
+    if (!poll.slope)
+        return poll_max_ms;
+
+    /* only the step the temperature heads for counts */
+    margin = acerhdf_curve_margin(filtered, poll.slope > 0);
+    if (margin <= adaptive_margin)
+        return lo;
+
+    /* ms until that step at the current slope */
+    reach = div_s64((s64) margin * 1000 * 1000, abs(poll.slope));
+
+    return clamp_t(s64, reach / 2, lo, poll_max_ms);
+}
+
+/* called once per new sample, i.e. once per wakeup */
+static void acerhdf_poll_step(unsigned int seq, int temp, int filtered) {
+    unsigned long elapsed;
+
+    if (seq == poll.seq)
+        return;
+    poll.seq = seq;
+
+    poll.count++;
+    elapsed = jiffies - poll.window;
+    if (elapsed >= 60 * HZ) {
+        poll.per_min = poll.count * 60 * HZ / elapsed;
+        poll.count = 0;
+        poll.window = jiffies;
+    }
+
+    if (!adaptive || control_period_ms || !thz_dev)
+        return;
+
+    WRITE_ONCE(poll_delay_ms, acerhdf_next_poll_delay(temp, filtered));
+    thz_dev->polling_delay = poll_delay_ms;
+}
+
+static int acerhdf_get_fanstate(int *state) {
+    u8 fan;
+
+    if (acerhdf_ec_read(ctrl_cfg.fanreg, &fan))
+        return -EINVAL;
+
+    *state = (int) fan;
+
+    return 0;
+}
+
+/* time spent in each fan state, -1 is the BIOS being in control */
+static void acerhdf_account_state(int state) {
+    ktime_t now = ktime_get();
+    u64 ns = ktime_to_ns(ktime_sub(now, stats.state_since));
+
+    if (stats.state == state)
+        return;
+
+    if (stats.state >= 0)
+        stats.state_ns[stats.state] += ns;
+    else if (stats.state_since)
+        stats.bios_ns += ns;
+    stats.state = state;
+    stats.state_since = now;
+}
+
+static int acerhdf_write_fanstate(int state) {
+    int err;
+
+    fanstate = state;
+    if (acerhdf_debug()) {
+        pr_notice("Fan speed: %i\n", state);
+    }
+
+    err = acerhdf_ec_write(ctrl_cfg.fanreg, (unsigned char) state);
+    if (err) {
+        fan_written = -1;
+        return err;
+    }
+
+    acerhdf_account_state(state);
+    if (state != fan_written)
+        acerhdf_notify("fan_state");
+    fan_written = state;
+    fan_written_at = jiffies;
+    return 0;
+}
+
+/* unconditionally write the fan state, used on mode changes and shutdown */
+static void acerhdf_change_fanstate(int state) {
+    acerhdf_ec_batch_begin();
+    acerhdf_write_fanstate(state);
+    acerhdf_ec_batch_end();
+}
+
+/* the periodic rewrite of an unchanged fan state written at written_at */
+static bool acerhdf_refresh_due(unsigned long written_at) {
+    unsigned int refresh = acerhdf_config_get(fan_refresh);
+
+    return refresh && !time_before(jiffies, written_at + refresh * HZ);
+}
+
+/*
+ * write the fan state only if it differs from the last acknowledged one or
+ * the periodic refresh is due, the EC is shared with battery, AC and hotkey
+ * handlers so every transaction we save is latency they don't see
+ */
+static int acerhdf_update_fanstate(int state) {
+    int err;
+
+    if (state == fan_written && !acerhdf_refresh_due(fan_written_at)) {
+        stats.writes_elided++;
+        trace_acerhdf_fan_state(state, fan_written, true);
+        return 0;
+    }
+
+    err = acerhdf_write_fanstate(state);
+    trace_acerhdf_fan_state(state, fan_written, false);
+
+    return err;
+}
+
+/*
+ * GPU fan. Models with a separate GPU fan get a second cooling device and
+ * thermal zone, acerhdf-gpu-fan and acerhdf-gpu. The fan follows its own
+ * curve over its own filter of the GPU temperature register, and is driven
+ * from the same control cycle (and EC batch) as the CPU fan. Emergency
+ * bypass, setpoint mode and output shaping only apply to the CPU fan.
+ */
+struct acerhdf_fan {
+    int temp;
+    int filtered;
+    int curve_out;
+    int written;
+    unsigned long written_at;
+    unsigned int seq;
+    u64 writes;
+    u64 writes_elided;
+    u64 transitions;
+    u64 read_errors;
+};
+
+static unsigned int gpu_fanreg;
+static unsigned int gpu_tempreg;
+static struct acerhdf_curve __rcu *gpu_curve;
+static struct acerhdf_fan gpu_fan = { .written = -1, .curve_out = -1 };
+static struct thermal_cooling_device *gpu_cl_dev;
+static struct thermal_zone_device *gpu_thz_dev;
+
+module_param(gpu_fanreg, uint, 0400);
+MODULE_PARM_DESC(gpu_fanreg, "EC register of the GPU fan, overrides the model table");
+module_param(gpu_tempreg, uint, 0400);
+MODULE_PARM_DESC(gpu_tempreg, "EC register of the GPU temperature, overrides the model table");
+module_param_cb(gpu_curve, &acerhdf_curve_param_ops, &gpu_curve, 0600);
+MODULE_PARM_DESC(gpu_curve, "GPU fan curve as temp:state[:hyst] points, e.g. \"" ACERHDF_DEFAULT_GPU_CURVE "\"");
+
+static bool acerhdf_has_gpu_fan(void) {
+    return ctrl_cfg.gpu_fanreg && ctrl_cfg.gpu_tempreg;
+}
+
+static int acerhdf_gpu_write(int state) {
+    int err;
+
+    err = acerhdf_ec_write(ctrl_cfg.gpu_fanreg, (unsigned char) state);
+    if (err) {
+        gpu_fan.written = -1;
+        return err;
+    }
+
+    if (state != gpu_fan.written)
+        gpu_fan.transitions++;
+    gpu_fan.writes++;
+    gpu_fan.written = state;
+    gpu_fan.written_at = jiffies;
+    return 0;
+}
+
+/* one GPU fan cycle, part of the CPU control step for sample seq */
+static void acerhdf_gpu_step(unsigned int seq) {
+    int state;
+    u8 val;
+
+    if (!acerhdf_has_gpu_fan() || seq == gpu_fan.seq)
+        return;
+    gpu_fan.seq = seq;
+
+    if (acerhdf_ec_read(ctrl_cfg.gpu_tempreg, &val)) {
+        /* keep the fan where it is, the CPU fan check hands off on errors */
+        gpu_fan.read_errors++;
+        return;
+    }
+    gpu_fan.temp = val * 1000;
+    gpu_fan.filtered = acerhdf_filter_temp(&gpu_filter, gpu_fan.temp, seq);
+    state = acerhdf_curve_state(&gpu_curve, gpu_fan.filtered / 1000,
+            &gpu_fan.curve_out);
+
+    if (state == gpu_fan.written &&
+            !acerhdf_refresh_due(gpu_fan.written_at)) {
+        gpu_fan.writes_elided++;
+        return;
+    }
+    acerhdf_gpu_write(state);
+}
+
+/* hand the GPU fan back to the BIOS, like the CPU one */
+static void acerhdf_gpu_release(void) {
+    if (!acerhdf_has_gpu_fan())
+        return;
+
+    acerhdf_ec_batch_begin();
+    acerhdf_gpu_write(5);
+    acerhdf_ec_batch_end();
+    gpu_fan.written = -1;
+    gpu_fan.curve_out = -1;
+}
+
+static int acerhdf_gpu_get_temp(struct thermal_zone_device *thermal, int *t) {
+    *t = gpu_fan.filtered / 1000;
+    return 0;
+}
+
+static struct thermal_zone_device_ops acerhdf_gpu_dev_ops = {
+    .get_temp = acerhdf_gpu_get_temp,
+};
+
+static int acerhdf_gpu_get_max_state(struct thermal_cooling_device *cdev,
+        unsigned long *state) {
+    *state = ACERHDF_MAX_STATE;
+    return 0;
+}
+
+static int acerhdf_gpu_get_cur_state(struct thermal_cooling_device *cdev,
+        unsigned long *state) {
+    *state = max(gpu_fan.written, 0);
+    return 0;
+}
+
+/* driven from the CPU control cycle, not by the thermal core */
+static int acerhdf_gpu_set_cur_state(struct thermal_cooling_device *cdev,
+        unsigned long state) {
+    return 0;
+}
+
+static const struct thermal_cooling_device_ops acerhdf_gpu_cooling_ops = {
+    .get_max_state = acerhdf_gpu_get_max_state,
+    .get_cur_state = acerhdf_gpu_get_cur_state,
+    .set_cur_state = acerhdf_gpu_set_cur_state,
+};
+
+/*
+ * This is the thermal zone callback which does the delayed polling of the fan
+ * state. Module parameters are validated when written, nothing to check here.
+ */
+static int acerhdf_get_ec_temp(struct thermal_zone_device *thermal, int *t) {
+    int temp, err = 0;
+
+    /* in kernel mode the control step accounts this read with its write */
+    acerhdf_ec_batch_begin();
+    ec_batch.hold = kernelmode && ec_batch.depth == 1;
+    err = acerhdf_get_zone_temp(&temp);
+    acerhdf_ec_batch_end();
+    if (err)
+        return err;
+    /* the zone reports whole degrees */
+    *t = temp / 1000;
+    return 0;
+}
+
+static int acerhdf_bind(struct thermal_zone_device *thermal,
+        struct thermal_cooling_device *cdev) {
+    /* if the cooling device is the one from acerhdf bind it */
+    if (cdev != cl_dev)
+        return 0;
+
+    if (thermal_zone_bind_cooling_device(thermal, 0, cdev,
+            THERMAL_NO_LIMIT, THERMAL_NO_LIMIT,
+            THERMAL_WEIGHT_DEFAULT)) {
+        pr_err("error binding cooling dev\n");
+        return -EINVAL;
+    }
+    return 0;
+}
+
+static int acerhdf_unbind(struct thermal_zone_device *thermal,
+        struct thermal_cooling_device *cdev) {
+    if (cdev != cl_dev)
+        return 0;
+
+    if (thermal_zone_unbind_cooling_device(thermal, 0, cdev)) {
+        pr_err("error unbinding cooling dev\n");
+        return -EINVAL;
+    }
+    return 0;
+}
+
+/* held across a control step and by mode changes from outside of it */
+static DEFINE_MUTEX(acerhdf_step_lock);
+
+/* caller holds acerhdf_step_lock, the failing control step does */
+static inline void acerhdf_revert_to_bios_mode(void) {
+    acerhdf_control_stop();
+    acerhdf_change_fanstate(5);
+    acerhdf_gpu_release();
+    acerhdf_account_state(-1);
+    manual_state = -1;
+    stats.bios_reverts++;
+    kernelmode = 0;
+    if (thz_dev)
+        thz_dev->polling_delay = 0;
+    trace_acerhdf_mode(false);
+    acerhdf_notify("mode");
+    pr_notice("kernel mode fan control OFF\n");
+}
+
+/*
+ * not under acerhdf_step_lock, the zone update below runs a step; no step
+ * runs before kernelmode is set
+ */
+static inline void acerhdf_enable_kernelmode(void) {
+    /* the BIOS owned the register until now, don't trust our last write */
+    fan_written = -1;
+    shape.out = -1;
+    gpu_fan.written = -1;
+    WRITE_ONCE(kernelmode, 1);
+
+    thz_dev->polling_delay = acerhdf_config_get(interval) * 1000;
+    thermal_zone_device_update(thz_dev, THERMAL_EVENT_UNSPECIFIED);
+    acerhdf_control_start();
+    trace_acerhdf_mode(true);
+    acerhdf_notify("mode");
+    pr_notice("kernel mode fan control ON\n");
+}
+
+/*
+ * mode change from userspace: the revert waits for a running control step,
+ * so that step can't write a kernel fan state after the BIOS got it back
+ */
+static void acerhdf_change_mode(bool on) {
+    if (on) {
+        if (!kernelmode)
+            acerhdf_enable_kernelmode();
+        return;
+    }
+
+    mutex_lock(&acerhdf_step_lock);
+    if (kernelmode)
+        acerhdf_revert_to_bios_mode();
+    mutex_unlock(&acerhdf_step_lock);
+}
+
+static int acerhdf_get_mode(struct thermal_zone_device *thermal,
+        enum thermal_device_mode *mode) {
+    if (acerhdf_verbose())
+        pr_notice("kernel mode fan control %d\n", kernelmode);
+
+    *mode = (kernelmode) ? THERMAL_DEVICE_ENABLED
+            : THERMAL_DEVICE_DISABLED;
+
+    return 0;
+}
+
+/*
+ * set operation mode;
+ * enabled: the thermal layer of the kernel takes care about
+ *          the temperature and the fan.
+ * disabled: the BIOS takes control of the fan.
+ */
+static int acerhdf_set_mode(struct thermal_zone_device *thermal,
+        enum thermal_device_mode mode) {
+    acerhdf_change_mode(mode == THERMAL_DEVICE_ENABLED);
+
+    return 0;
+}
+
+static int acerhdf_get_trip_type(struct thermal_zone_device *thermal, int trip,
+        enum thermal_trip_type *type) {
+    if (trip == 0)
+        *type = THERMAL_TRIP_ACTIVE;
+    else if (trip == 1)
+        *type = THERMAL_TRIP_CRITICAL;
+    else
+        return -EINVAL;
+
+    return 0;
+}
+
+static int acerhdf_get_trip_hyst(struct thermal_zone_device *thermal, int trip,
+        int *temp) {
+    const struct acerhdf_config *c;
+
+    if (trip != 0)
+        return -EINVAL;
+
+    rcu_read_lock();
+    c = rcu_dereference(cur_config);
+    *temp = c->fanon - c->fanoff;
+    rcu_read_unlock();
+
+    return 0;
+}
+
+static int acerhdf_get_trip_temp(struct thermal_zone_device *thermal, int trip,
+        int *temp) {
+    if (trip == 0)
+        *temp = acerhdf_config_get(fanon);
+    else if (trip == 1)
+        *temp = ACERHDF_TEMP_CRIT;
+    else
+        return -EINVAL;
+
+    return 0;
+}
+
+static int acerhdf_get_crit_temp(struct thermal_zone_device *thermal,
+        int *temperature) {
+    *temperature = ACERHDF_TEMP_CRIT;
+    return 0;
+}
+
+/* bind callback functions to thermalzone */
+static struct thermal_zone_device_ops acerhdf_dev_ops = {
+    .bind = acerhdf_bind,
+    .unbind = acerhdf_unbind,
+    .get_temp = acerhdf_get_ec_temp,
+    .get_mode = acerhdf_get_mode,
+    .set_mode = acerhdf_set_mode,
+    .get_trip_type = acerhdf_get_trip_type,
+    .get_trip_hyst = acerhdf_get_trip_hyst,
+    .get_trip_temp = acerhdf_get_trip_temp,
+    .get_crit_temp = acerhdf_get_crit_temp,
+};
+
+/*
+ * cooling device callback functions
+ * get maximal fan cooling state
+ */
+static int acerhdf_get_max_state(struct thermal_cooling_device *cdev,
+        unsigned long *state) {
+    *state = ACERHDF_MAX_STATE;
+
+    return 0;
+}
+
+/*
+ * Fan state for readers outside the control cycle, the cooling device and
+ * hwmon. In kernel mode that's our last write, under BIOS control the
+ * register is read at most once per hwmon_max_age_ms however many readers
+ * there are.
+ */
+struct acerhdf_fan_cache {
+    int state;
+    unsigned long stamp;
+};
+
+static unsigned int hwmon_max_age_ms = 2000;
+static struct acerhdf_fan_cache fan_cache = { .state = -1 };
+
+static const struct acerhdf_uint_param hwmon_max_age_ms_param = {
+    &hwmon_max_age_ms, 500, 60000, NULL
+};
+
+module_param_cb(hwmon_max_age_ms, &acerhdf_uint_ops, &hwmon_max_age_ms_param,
+        0600);
+MODULE_PARM_DESC(hwmon_max_age_ms, "Serve hwmon and cur_state reads from data at most this old (ms)");
+
+static int acerhdf_fan_snapshot(int *state) {
+    int err = 0;
+
+    /* in kernel mode the register holds what we last wrote */
+    if (kernelmode && fan_written >= 0) {
+        *state = fan_written;
+        return 0;
+    }
+
+    acerhdf_ec_batch_begin();
+    if (fan_cache.state < 0 || time_after(jiffies, fan_cache.stamp +
+            msecs_to_jiffies(READ_ONCE(hwmon_max_age_ms)))) {
+        err = acerhdf_get_fanstate(&fan_cache.state);
+        if (err)
+            fan_cache.state = -1;
+        fan_cache.stamp = jiffies;
+    }
+    *state = fan_cache.state;
+    acerhdf_ec_batch_end();
+
+    return err;
+}
+
+static int acerhdf_get_cur_state(struct thermal_cooling_device *cdev,
+        unsigned long *state) {
+    int err, tmp;
+
+    err = acerhdf_fan_snapshot(&tmp);
+    if (err)
+        return err;
+
+    *state = (unsigned long) tmp;
+    return 0;
+}
+
+/*
+ * Temperature bands for notification: temp_band lists up to 8 thresholds in
+ * degrees, the band is the number of them at or below the filtered
+ * temperature. Only a change of band wakes up the temp_band pollers.
+ */
+#define ACERHDF_MAX_BANDS 8
+
+static unsigned int temp_band[ACERHDF_MAX_BANDS] = { 50, 70, 85 };
+static unsigned int temp_band_count = 3;
+static int cur_band = -1;
+
+module_param_array(temp_band, uint, &temp_band_count, 0600);
+MODULE_PARM_DESC(temp_band, "Notify temp_band pollers when the temperature crosses these degrees");
+
+static void acerhdf_band_step(int temp) {
+    unsigned int i, n = min_t(unsigned int, READ_ONCE(temp_band_count),
+            ACERHDF_MAX_BANDS);
+    int band = 0;
+
+    for (i = 0; i < n; i++)
+        if (temp >= (int) READ_ONCE(temp_band[i]))
+            band++;
+
+    if (band != cur_band) {
+        cur_band = band;
+        acerhdf_notify("temp_band");
+    }
+}
+
+/*
+ * Telemetry ring: every control cycle appends a record to a vmalloc_user
+ * buffer that userspace maps read-only through /dev/acerhdf, layout and
+ * reader protocol are in acerhdf_ring.h. The step lock makes
+ * acerhdf_set_cur_state() the single producer, readers never block it and
+ * detect overruns from head and the per-record sequence numbers.
+ */
+struct acerhdf_cycle {
+    unsigned int sample;
+    int raw;
+    int filtered;
+    int state;
+};
+
+static unsigned int ring_size = 1024;
+static struct acerhdf_cycle cycle;
+static struct acerhdf_ring_header *ring;
+static size_t ring_bytes;
+
+module_param(ring_size, uint, 0400);
+MODULE_PARM_DESC(ring_size, "Telemetry ring records, rounded up to a power of two (16-65536), 0 = off");
+
+static void acerhdf_ring_append(void) {
+    struct acerhdf_ring_record *rec;
+    u64 head;
+
+    if (!ring)
+        return;
+
+    head = ring->head;
+    rec = (void *) ring + ring->offset;
+    rec += head & (ring->size - 1);
+
+    WRITE_ONCE(rec->seq, 0);
+    smp_wmb();
+    rec->time_ns = ktime_get_ns();
+    rec->sample = cycle.sample;
+    rec->raw = cycle.raw;
+    rec->filtered = cycle.filtered;
+    rec->state = cycle.state;
+    rec->written = fan_written;
+    rec->ec_latency_ns = min_t(s64, ec_batch.last_ns, U32_MAX);
+    smp_store_release(&rec->seq, head + 1);
+    smp_store_release(&ring->head, head + 1);
+}
+
+static int acerhdf_ring_mmap(struct file *file, struct vm_area_struct *vma) {
+    if (vma->vm_flags & VM_WRITE)
+        return -EPERM;
+    vma->vm_flags &= ~VM_MAYWRITE;
+
+    return remap_vmalloc_range(vma, ring, vma->vm_pgoff);
+}
+
+static const struct file_operations acerhdf_ring_fops = {
+    .owner = THIS_MODULE,
+    .open = nonseekable_open,
+    .mmap = acerhdf_ring_mmap,
+    .llseek = noop_llseek,
+};
+
+static struct miscdevice acerhdf_ring_dev = {
+    .minor = MISC_DYNAMIC_MINOR,
+    .name = "acerhdf",
+    .fops = &acerhdf_ring_fops,
+    .mode = 0444,
+};
+
+/* telemetry is optional, the driver works without it */
+static void __init acerhdf_ring_init(void) {
+    unsigned int n;
+
+    if (!ring_size)
+        return;
+
+    n = roundup_pow_of_two(clamp(ring_size, 16U, 65536U));
+    ring_bytes = PAGE_ALIGN(sizeof (*ring) +
+            (size_t) n * sizeof (struct acerhdf_ring_record));
+    ring = vmalloc_user(ring_bytes);
+    if (!ring) {
+        pr_warn("no memory for the telemetry ring\n");
+        return;
+    }
+
+    ring->magic = ACERHDF_RING_MAGIC;
+    ring->version = ACERHDF_RING_VERSION;
+    ring->size = n;
+    ring->record_size = sizeof (struct acerhdf_ring_record);
+    ring->offset = sizeof (*ring);
+
+    if (misc_register(&acerhdf_ring_dev)) {
+        pr_warn("telemetry device registration failed\n");
+        vfree(ring);
+        ring = NULL;
+    }
+}
+
+static void acerhdf_ring_exit(void) {
+    if (!ring)
+        return;
+
+    /* an open or mapped device pins the module, so nobody maps it now */
+    misc_deregister(&acerhdf_ring_dev);
+    vfree(ring);
+    ring = NULL;
+}
+
+/*
+ * One control cycle: sample, filter, controller, output shaping, fan write.
+ * Runs from the cooling device callback and directly on resume, when the
+ * thermal core doesn't update zones yet. Serialized by acerhdf_step_lock.
+ */
+static int acerhdf_control_step(void) {
+    int cur_temp, raw_temp, ec_temp, filtered, manual, err;
+    unsigned long state;
+    unsigned int seq;
+
+    /* the temperature read and fan write share one EC window */
+    acerhdf_ec_batch_begin();
+    ec_batch.adopt = ec_batch.depth == 1;
+    err = acerhdf_get_temp(&raw_temp, &ec_temp, &seq);
+    if (err) {
+        pr_err("error reading temperature, hand off control to BIOS\n");
+        goto err_out;
+    }
+    filtered = acerhdf_filter_temp(&temp_filter, raw_temp, seq);
+    cur_temp = filtered / 1000;
+    cycle.sample = seq;
+    cycle.raw = raw_temp;
+    cycle.filtered = filtered;
+    trace_acerhdf_sample(seq, raw_temp, filtered);
+    acerhdf_poll_step(seq, raw_temp, cur_temp);
+    acerhdf_band_step(cur_temp);
+
+    if (acerhdf_debug()) {
+        pr_notice("AVG Temperature: %i\n", cur_temp);
+    }
+
+    /* judged on the EC like the zone, package sensor bursts are normal */
+    if (acerhdf_emergency_check(seq, ec_temp, filtered)) {
+        acerhdf_shape_hold(&shape, ACERHDF_MAX_STATE,
+                jiffies_to_msecs(jiffies));
+        acerhdf_count_transition(ACERHDF_MAX_STATE);
+        cycle.state = ACERHDF_MAX_STATE;
+        acerhdf_update_fanstate(ACERHDF_MAX_STATE);
+        acerhdf_emergency_done();
+        acerhdf_gpu_step(seq);
+        acerhdf_ec_batch_end();
+        return 0;
+    }
+
+    manual = READ_ONCE(manual_state);
+    if (manual >= 0) {
+        /* hwmon manual mode, the user owns the CPU fan */
+        state = manual;
+        shape.out = manual;
+        goto write;
+    }
+
+    if (control_mode == ACERHDF_MODE_PID) {
+        state = acerhdf_pid_step(seq, filtered);
+    } else {
+        /* start the pid from scratch next time it is selected */
+        if (pid.primed)
+            acerhdf_pid_reset();
+        state = acerhdf_curve_state(&fan_curve, cur_temp, &curve_out);
+    }
+    if (power_ff) {
+        int power_mw = acerhdf_rapl_power(seq);
+
+        if (power_mw >= 0)
+            state = max_t(unsigned long, state,
+                    acerhdf_curve_state(&power_curve, power_mw / 1000,
+                    &power_out));
+    }
+    state = acerhdf_shape_state(state);
+write:
+    cycle.state = state;
+    acerhdf_count_transition(state);
+    acerhdf_update_fanstate((int) state);
+    acerhdf_gpu_step(seq);
+    acerhdf_ec_batch_end();
+    return 0;
+
+err_out:
+    acerhdf_revert_to_bios_mode();
+    acerhdf_ec_batch_end();
+    return -EINVAL;
+}
+
+/* change current fan state - is overwritten when running in kernel mode */
+static int acerhdf_set_cur_state(struct thermal_cooling_device *cdev,
+        unsigned long state) {
+    ktime_t start;
+    u64 ns;
+    int err;
+
+    if (!kernelmode)
+        return 0;
+
+    mutex_lock(&acerhdf_step_lock);
+    /* a BIOS revert may have run while we waited for the lock */
+    if (!kernelmode) {
+        mutex_unlock(&acerhdf_step_lock);
+        return 0;
+    }
+    start = ktime_get();
+    err = acerhdf_control_step();
+    ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+    stats.steps++;
+    stats.step_sum_ns += ns;
+    stats.step_min_ns = min(stats.step_min_ns, ns);
+    stats.step_max_ns = max(stats.step_max_ns, ns);
+    if (!err)
+        acerhdf_ring_append();
+    mutex_unlock(&acerhdf_step_lock);
+
+    return err;
+}
+
+/* bind fan callbacks to fan device */
+static const struct thermal_cooling_device_ops acerhdf_cooling_ops = {
+    .get_max_state = acerhdf_get_max_state,
+    .get_cur_state = acerhdf_get_cur_state,
+    .set_cur_state = acerhdf_set_cur_state,
 };
 
 /*
- * this struct is used to instruct thermal layer to use bang_bang instead of
- * default governor for acerhdf
+ * Seed the filter with a real reading so it doesn't start from nothing, and
+ * forget everything derived from samples before this point.
  */
-static struct thermal_zone_params acerhdf_zone_params = {
-    .governor_name = "bang_bang",
-};
+static void acerhdf_warm_start(void) {
+    unsigned int seq;
+    int temp;
+
+    mutex_lock(&acerhdf_sample_lock);
+    ec_sample.valid = false;
+    fusion.primed = false;
+    mutex_unlock(&acerhdf_sample_lock);
+
+    /* the GPU filter starts over from its first sample */
+    mutex_lock(&acerhdf_filter_lock);
+    acerhdf_filter_reset(&gpu_filter);
+    mutex_unlock(&acerhdf_filter_lock);
+    gpu_fan.seq = 0;
+
+    if (acerhdf_get_temp(&temp, NULL, &seq)) {
+        acerhdf_filter_reset(&temp_filter);
+        return;
+    }
+    acerhdf_filter_prefill(temp, seq);
 
-static int acerhdf_get_temp(int *temp) {
-    u8 read_temp;
+    poll.primed = false;
+    emergency.ctl.primed = false;
+    rapl.primed = false;
+    acerhdf_pid_reset();
+}
 
-    if (ec_read(ctrl_cfg.tempreg, &read_temp))
-        return -EINVAL;
+/* suspend / resume functionality */
+static int acerhdf_suspend(struct device *dev) {
+    acerhdf_control_stop();
+    if (kernelmode) {
+        acerhdf_change_fanstate(5);
+        acerhdf_gpu_release();
+    }
 
-    *temp = read_temp;
+    if (acerhdf_verbose())
+        pr_notice("going suspend\n");
 
     return 0;
 }
 
-static int acerhdf_get_fanstate(int *state) {
-    u8 fan;
-
-    if (ec_read(ctrl_cfg.fanreg, &fan))
-        return -EINVAL;
+static int acerhdf_resume(struct device *dev) {
+    if (acerhdf_verbose())
+        pr_notice("resuming\n");
+
+    mutex_lock(&acerhdf_step_lock);
+    acerhdf_warm_start();
+    if (kernelmode) {
+        /* the EC may have been reset, rewrite the fan state right away */
+        fan_written = -1;
+        shape.out = -1;
+        gpu_fan.written = -1;
+        acerhdf_control_step();
+    }
+    mutex_unlock(&acerhdf_step_lock);
 
-    *state = (int) fan;
+    if (kernelmode)
+        acerhdf_control_start();
 
     return 0;
 }
 
-static void acerhdf_change_fanstate(int state) {
-    fanstate = state;
-    if (fan_speed_debug) {
-        pr_notice("Fan speed: %i\n", state);
-    }
+/* statistics exported through the platform device */
+static ssize_t ec_writes_show(struct device *dev,
+        struct device_attribute *attr, char *buf) {
+    return sprintf(buf, "%llu\n", stats.ec_writes);
+}
+static DEVICE_ATTR_RO(ec_writes);
 
-    ec_write(ctrl_cfg.fanreg, (unsigned char) state);
+static ssize_t ec_writes_elided_show(struct device *dev,
+        struct device_attribute *attr, char *buf) {
+    return sprintf(buf, "%llu\n", stats.writes_elided);
 }
+static DEVICE_ATTR_RO(ec_writes_elided);
 
-static void acerhdf_check_param(struct thermal_zone_device *thermal) {
-    if (fanon > ACERHDF_MAX_FANON) {
-        pr_err("fanon temperature too high, set to %d\n",
-                ACERHDF_MAX_FANON);
-        fanon = ACERHDF_MAX_FANON;
-    }
+static ssize_t wakeups_per_min_show(struct device *dev,
+        struct device_attribute *attr, char *buf) {
+    return sprintf(buf, "%u\n", poll.per_min);
+}
+static DEVICE_ATTR_RO(wakeups_per_min);
 
-    if (kernelmode && prev_interval != interval) {
-        if (interval > ACERHDF_MAX_INTERVAL) {
-            pr_err("interval too high, set to %d\n",
-                    ACERHDF_MAX_INTERVAL);
-            interval = ACERHDF_MAX_INTERVAL;
-        }
-        if (verbose)
-            pr_notice("interval changed to: %d\n", interval);
-        thermal->polling_delay = interval * 1000;
-        prev_interval = interval;
-    }
+static ssize_t poll_interval_ms_show(struct device *dev,
+        struct device_attribute *attr, char *buf) {
+    return sprintf(buf, "%u\n", poll_delay_ms);
 }
+static DEVICE_ATTR_RO(poll_interval_ms);
 
-/*
- * This is the thermal zone callback which does the delayed polling of the fan
- * state. We do check /sysfs-originating settings here in acerhdf_check_param()
- * as late as the polling interval is since we can't do that in the respective
- * accessors of the module parameters.
- */
-static int acerhdf_get_ec_temp(struct thermal_zone_device *thermal, int *t) {
-    int temp, err = 0;
+static ssize_t control_interval_us_show(struct device *dev,
+        struct device_attribute *attr, char *buf) {
+    s64 avg = control.runs > 1 ?
+            div64_s64(control.sum_us, control.runs - 1) : 0;
 
-    acerhdf_check_param(thermal);
+    if (control.runs < 2)
+        return sprintf(buf, "0 0 0 0\n");
 
-    err = acerhdf_get_temp(&temp);
-    if (err)
-        return err;
-    *t = temp;
-    return 0;
+    return sprintf(buf, "%lld %lld %lld %lld\n", control.interval_us,
+            control.min_us, avg, control.max_us);
 }
+static DEVICE_ATTR_RO(control_interval_us);
 
-static int acerhdf_bind(struct thermal_zone_device *thermal,
-        struct thermal_cooling_device *cdev) {
-    /* if the cooling device is the one from acerhdf bind it */
-    if (cdev != cl_dev)
-        return 0;
+static ssize_t control_jitter_show(struct device *dev,
+        struct device_attribute *attr, char *buf) {
+    int i, len = 0;
 
-    if (thermal_zone_bind_cooling_device(thermal, 0, cdev,
-            THERMAL_NO_LIMIT, THERMAL_NO_LIMIT,
-            THERMAL_WEIGHT_DEFAULT)) {
-        pr_err("error binding cooling dev\n");
-        return -EINVAL;
-    }
-    return 0;
+    for (i = 0; i < ACERHDF_JITTER_BUCKETS - 1; i++)
+        len += sprintf(buf + len, "<%lu us: %lu\n", 1UL << i,
+                control.jitter[i]);
+    len += sprintf(buf + len, ">=%lu us: %lu\nmissed: %llu\n",
+            1UL << (i - 1), control.jitter[i], control.missed);
+
+    return len;
 }
+static DEVICE_ATTR_RO(control_jitter);
 
-static int acerhdf_unbind(struct thermal_zone_device *thermal,
-        struct thermal_cooling_device *cdev) {
-    if (cdev != cl_dev)
-        return 0;
+static ssize_t package_power_mw_show(struct device *dev,
+        struct device_attribute *attr, char *buf) {
+    if (!rapl.available || rapl.power_mw < 0)
+        return -ENODATA;
 
-    if (thermal_zone_unbind_cooling_device(thermal, 0, cdev)) {
-        pr_err("error unbinding cooling dev\n");
-        return -EINVAL;
+    return sprintf(buf, "%d\n", rapl.power_mw);
+}
+static DEVICE_ATTR_RO(package_power_mw);
+
+static ssize_t pid_terms_show(struct device *dev,
+        struct device_attribute *attr, char *buf) {
+    return sprintf(buf, "%d %d %d %d\n", pid.p, pid.i, pid.d, pid.out);
+}
+static DEVICE_ATTR_RO(pid_terms);
+
+/* fused estimate in millidegrees and its variance in millidegrees squared */
+static ssize_t fused_temp_show(struct device *dev,
+        struct device_attribute *attr, char *buf) {
+    return sprintf(buf, "%lld %lld\n", fusion.x, fusion.p);
+}
+static DEVICE_ATTR_RO(fused_temp);
+
+/* every input with its last reading, the one in control is marked with * */
+static ssize_t inputs_show(struct device *dev,
+        struct device_attribute *attr, char *buf) {
+    const struct acerhdf_extra_input *e;
+    unsigned int i;
+    int len;
+
+    mutex_lock(&acerhdf_inputs_lock);
+    len = sprintf(buf, "%scpu %d\n", inputs.winner < 0 ? "*" : "",
+            inputs.cpu);
+    for (i = 0; i < inputs.n; i++) {
+        e = &inputs.in[i];
+        if (e->temp == INT_MIN)
+            len += sprintf(buf + len, "%s -\n", e->name);
+        else
+            len += sprintf(buf + len, "%s%s %d\n",
+                    inputs.winner == (int) i ? "*" : "", e->name,
+                    e->temp + e->offset);
     }
-    return 0;
+    mutex_unlock(&acerhdf_inputs_lock);
+
+    return len;
 }
+static DEVICE_ATTR_RO(inputs);
 
-static inline void acerhdf_revert_to_bios_mode(void) {
-    acerhdf_change_fanstate(5);
-    kernelmode = 0;
-    if (thz_dev)
-        thz_dev->polling_delay = 0;
-    pr_notice("kernel mode fan control OFF\n");
+static ssize_t input_winner_show(struct device *dev,
+        struct device_attribute *attr, char *buf) {
+    int len;
+
+    mutex_lock(&acerhdf_inputs_lock);
+    len = sprintf(buf, "%s\n", inputs.winner < 0 ? "cpu" :
+            inputs.in[inputs.winner].name);
+    mutex_unlock(&acerhdf_inputs_lock);
+
+    return len;
+}
+static DEVICE_ATTR_RO(input_winner);
+
+/* per fan: state, temperature, writes, elided writes, state changes */
+static ssize_t fans_show(struct device *dev,
+        struct device_attribute *attr, char *buf) {
+    int len;
+
+    len = sprintf(buf, "cpu %d %d %llu %llu %llu\n", fan_written,
+            ec_sample.temp * 1000, stats.ec_writes, stats.writes_elided,
+            stats.transitions);
+    if (acerhdf_has_gpu_fan())
+        len += sprintf(buf + len, "gpu %d %d %llu %llu %llu\n",
+                gpu_fan.written, gpu_fan.temp, gpu_fan.writes,
+                gpu_fan.writes_elided, gpu_fan.transitions);
+
+    return len;
 }
+static DEVICE_ATTR_RO(fans);
 
-static inline void acerhdf_enable_kernelmode(void) {
-    kernelmode = 1;
+static ssize_t transitions_show(struct device *dev,
+        struct device_attribute *attr, char *buf) {
+    return sprintf(buf, "%llu\n", stats.transitions);
+}
+static DEVICE_ATTR_RO(transitions);
 
-    thz_dev->polling_delay = interval * 1000;
-    thermal_zone_device_update(thz_dev, THERMAL_EVENT_UNSPECIFIED);
-    pr_notice("kernel mode fan control ON\n");
+static ssize_t transitions_per_min_show(struct device *dev,
+        struct device_attribute *attr, char *buf) {
+    return sprintf(buf, "%u\n", transitions.per_min);
 }
+static DEVICE_ATTR_RO(transitions_per_min);
 
-static int acerhdf_get_mode(struct thermal_zone_device *thermal,
-        enum thermal_device_mode *mode) {
-    if (verbose)
-        pr_notice("kernel mode fan control %d\n", kernelmode);
+static ssize_t emergency_show(struct device *dev,
+        struct device_attribute *attr, char *buf) {
+    return sprintf(buf, "%d %lu %lld %lld\n", emergency.ctl.boosted,
+            emergency.entries, emergency.latency_us,
+            emergency.max_latency_us);
+}
+static DEVICE_ATTR_RO(emergency);
 
-    *mode = (kernelmode) ? THERMAL_DEVICE_ENABLED
-            : THERMAL_DEVICE_DISABLED;
+/* pollable, see acerhdf_notify() */
+static ssize_t fan_state_show(struct device *dev,
+        struct device_attribute *attr, char *buf) {
+    return sprintf(buf, "%d\n", fan_written);
+}
+static DEVICE_ATTR_RO(fan_state);
 
-    return 0;
+static ssize_t mode_show(struct device *dev,
+        struct device_attribute *attr, char *buf) {
+    return sprintf(buf, "%s\n", kernelmode ? "kernel" : "bios");
+}
+static DEVICE_ATTR_RO(mode);
+
+static ssize_t temp_band_show(struct device *dev,
+        struct device_attribute *attr, char *buf) {
+    return sprintf(buf, "%d\n", cur_band);
 }
+static DEVICE_ATTR_RO(temp_band);
+
+static struct attribute *acerhdf_attrs[] = {
+    &dev_attr_ec_writes.attr,
+    &dev_attr_ec_writes_elided.attr,
+    &dev_attr_wakeups_per_min.attr,
+    &dev_attr_poll_interval_ms.attr,
+    &dev_attr_control_interval_us.attr,
+    &dev_attr_control_jitter.attr,
+    &dev_attr_package_power_mw.attr,
+    &dev_attr_pid_terms.attr,
+    &dev_attr_fused_temp.attr,
+    &dev_attr_inputs.attr,
+    &dev_attr_input_winner.attr,
+    &dev_attr_fans.attr,
+    &dev_attr_fan_state.attr,
+    &dev_attr_mode.attr,
+    &dev_attr_temp_band.attr,
+    &dev_attr_transitions.attr,
+    &dev_attr_transitions_per_min.attr,
+    &dev_attr_emergency.attr,
+    NULL
+};
+ATTRIBUTE_GROUPS(acerhdf);
 
 /*
- * set operation mode;
- * enabled: the thermal layer of the kernel takes care about
- *          the temperature and the fan.
- * disabled: the BIOS takes control of the fan.
+ * debugfs: /sys/kernel/debug/acerhdf/ holds the raw counters, time spent in
+ * each fan state, the cost of a control step, and a reset knob
  */
-static int acerhdf_set_mode(struct thermal_zone_device *thermal,
-        enum thermal_device_mode mode) {
-    if (mode == THERMAL_DEVICE_DISABLED && kernelmode)
-        acerhdf_revert_to_bios_mode();
-    else if (mode == THERMAL_DEVICE_ENABLED && !kernelmode)
-        acerhdf_enable_kernelmode();
+static struct dentry *acerhdf_debugfs;
 
-    return 0;
-}
+static int acerhdf_time_in_state_show(struct seq_file *m, void *v) {
+    u64 ns = ktime_to_ns(ktime_sub(ktime_get(), stats.state_since));
+    int i;
 
-static int acerhdf_get_trip_type(struct thermal_zone_device *thermal, int trip,
-        enum thermal_trip_type *type) {
-    if (trip == 0)
-        *type = THERMAL_TRIP_ACTIVE;
-    else if (trip == 1)
-        *type = THERMAL_TRIP_CRITICAL;
-    else
-        return -EINVAL;
+    for (i = 0; i <= ACERHDF_MAX_STATE; i++)
+        seq_printf(m, "%d %llu\n", i, div_u64(stats.state_ns[i] +
+                (stats.state == i ? ns : 0), NSEC_PER_MSEC));
+    seq_printf(m, "bios %llu\n", div_u64(stats.bios_ns +
+            (stats.state < 0 && stats.state_since ? ns : 0),
+            NSEC_PER_MSEC));
 
     return 0;
 }
+DEFINE_SHOW_ATTRIBUTE(acerhdf_time_in_state);
 
-static int acerhdf_get_trip_hyst(struct thermal_zone_device *thermal, int trip,
-        int *temp) {
-    if (trip != 0)
-        return -EINVAL;
+static int acerhdf_step_ns_show(struct seq_file *m, void *v) {
+    if (!stats.steps) {
+        seq_puts(m, "0 0 0\n");
+        return 0;
+    }
 
-    *temp = fanon - fanoff;
+    seq_printf(m, "%llu %llu %llu\n", stats.step_min_ns,
+            div64_u64(stats.step_sum_ns, stats.steps), stats.step_max_ns);
 
     return 0;
 }
+DEFINE_SHOW_ATTRIBUTE(acerhdf_step_ns);
 
-static int acerhdf_get_trip_temp(struct thermal_zone_device *thermal, int trip,
-        int *temp) {
-    if (trip == 0)
-        *temp = fanon;
-    else if (trip == 1)
-        *temp = ACERHDF_TEMP_CRIT;
-    else
-        return -EINVAL;
+/* one line per bucket: upper bound in us, single accesses and batches */
+static int acerhdf_ec_latency_show(struct seq_file *m, void *v) {
+    int i;
 
-    return 0;
-}
+    for (i = 0; i < ACERHDF_LATENCY_BUCKETS - 1; i++)
+        seq_printf(m, "<%lu %llu %llu\n", 1UL << i, stats.ec_latency[i],
+                stats.ec_batch_latency[i]);
+    seq_printf(m, ">=%lu %llu %llu\n", 1UL << (i - 1), stats.ec_latency[i],
+            stats.ec_batch_latency[i]);
 
-static int acerhdf_get_crit_temp(struct thermal_zone_device *thermal,
-        int *temperature) {
-    *temperature = ACERHDF_TEMP_CRIT;
     return 0;
 }
+DEFINE_SHOW_ATTRIBUTE(acerhdf_ec_latency);
+
+static ssize_t acerhdf_reset_write(struct file *file, const char __user *buf,
+        size_t count, loff_t *ppos) {
+    mutex_lock(&acerhdf_step_lock);
+    memset(stats.state_ns, 0, sizeof (stats.state_ns));
+    stats.ec_reads = 0;
+    stats.ec_read_errors = 0;
+    stats.ec_writes = 0;
+    stats.ec_write_errors = 0;
+    stats.writes_elided = 0;
+    stats.transitions = 0;
+    stats.bios_reverts = 0;
+    stats.bios_ns = 0;
+    stats.state_since = ktime_get();
+    stats.steps = 0;
+    stats.step_min_ns = U64_MAX;
+    stats.step_max_ns = 0;
+    stats.step_sum_ns = 0;
+    memset(stats.ec_latency, 0, sizeof (stats.ec_latency));
+    memset(stats.ec_batch_latency, 0, sizeof (stats.ec_batch_latency));
+    stats.ec_budget_overruns = 0;
+    stats.ec_batches = 0;
+    mutex_unlock(&acerhdf_step_lock);
+
+    return count;
+}
 
-/* bind callback functions to thermalzone */
-static struct thermal_zone_device_ops acerhdf_dev_ops = {
-    .bind = acerhdf_bind,
-    .unbind = acerhdf_unbind,
-    .get_temp = acerhdf_get_ec_temp,
-    .get_mode = acerhdf_get_mode,
-    .set_mode = acerhdf_set_mode,
-    .get_trip_type = acerhdf_get_trip_type,
-    .get_trip_hyst = acerhdf_get_trip_hyst,
-    .get_trip_temp = acerhdf_get_trip_temp,
-    .get_crit_temp = acerhdf_get_crit_temp,
+static const struct file_operations acerhdf_reset_fops = {
+    .owner = THIS_MODULE,
+    .open = simple_open,
+    .write = acerhdf_reset_write,
+    .llseek = noop_llseek,
 };
 
+static void acerhdf_debugfs_init(void) {
+    struct dentry *dir = debugfs_create_dir("acerhdf", NULL);
+
+    acerhdf_debugfs = dir;
+    debugfs_create_u64("ec_reads", 0444, dir, &stats.ec_reads);
+    debugfs_create_u64("ec_read_errors", 0444, dir, &stats.ec_read_errors);
+    debugfs_create_u64("ec_writes", 0444, dir, &stats.ec_writes);
+    debugfs_create_u64("ec_write_errors", 0444, dir, &stats.ec_write_errors);
+    debugfs_create_u64("writes_elided", 0444, dir, &stats.writes_elided);
+    debugfs_create_u64("transitions", 0444, dir, &stats.transitions);
+    debugfs_create_u64("bios_reverts", 0444, dir, &stats.bios_reverts);
+    debugfs_create_file("time_in_state_ms", 0444, dir, NULL,
+            &acerhdf_time_in_state_fops);
+    debugfs_create_file("step_ns", 0444, dir, NULL, &acerhdf_step_ns_fops);
+    debugfs_create_file("ec_latency_us", 0444, dir, NULL,
+            &acerhdf_ec_latency_fops);
+    debugfs_create_u64("ec_budget_overruns", 0444, dir,
+            &stats.ec_budget_overruns);
+    debugfs_create_u64("ec_batches", 0444, dir, &stats.ec_batches);
+    debugfs_create_file("reset", 0200, dir, NULL, &acerhdf_reset_fops);
+}
+
+static void acerhdf_debugfs_exit(void) {
+    debugfs_remove_recursive(acerhdf_debugfs);
+    acerhdf_debugfs = NULL;
+}
+
 /*
- * cooling device callback functions
- * get maximal fan cooling state
+ * hwmon: temp1/pwm1 are the CPU side, temp1 the EC reading rather than the
+ * control input, temp2/pwm2 the GPU fan if there is one. pwm is the fan
+ * state scaled to 0-255. pwm1_enable: 1 = manual (pwm1 writable),
+ * 2 = curve or setpoint control, 3 = BIOS. Reads are served from the last
+ * control cycle and only go to the EC once the data is older than
+ * hwmon_max_age_ms.
  */
-static int acerhdf_get_max_state(struct thermal_cooling_device *cdev,
-        unsigned long *state) {
-    *state = 11;
+static struct device *acerhdf_hwmon;
 
-    return 0;
+static long acerhdf_state_to_pwm(int state) {
+    return DIV_ROUND_CLOSEST(max(state, 0) * 255, ACERHDF_MAX_STATE);
 }
 
-static int acerhdf_get_cur_state(struct thermal_cooling_device *cdev,
-        unsigned long *state) {
-    int err = 0, tmp;
+static int acerhdf_hwmon_temp(long *val) {
+    unsigned long max_age = msecs_to_jiffies(READ_ONCE(hwmon_max_age_ms));
+    int temp, err;
 
-    err = acerhdf_get_fanstate(&tmp);
-    if (err)
-        return err;
+    mutex_lock(&acerhdf_sample_lock);
+    if (ec_sample.valid && time_before(jiffies, ec_sample.stamp + max_age)) {
+        *val = ec_sample.temp * 1000;
+        mutex_unlock(&acerhdf_sample_lock);
+        return 0;
+    }
+    mutex_unlock(&acerhdf_sample_lock);
 
-    *state = (unsigned long) tmp;
-    return 0;
+    err = acerhdf_get_zone_temp(&temp);
+    if (!err)
+        *val = temp;
+
+    return err;
 }
 
-/* change current fan state - is overwritten when running in kernel mode */
-static int acerhdf_set_cur_state(struct thermal_cooling_device *cdev,
-        unsigned long state) {
-    int cur_temp, cur_state, err,i = 0;
-    if (!kernelmode)
+/* run a cycle now instead of at the next poll */
+static void acerhdf_hwmon_kick(void) {
+    if (kernelmode && thz_dev)
+        thermal_zone_device_update(thz_dev, THERMAL_EVENT_UNSPECIFIED);
+}
+
+static umode_t acerhdf_hwmon_is_visible(const void *data,
+        enum hwmon_sensor_types type, u32 attr, int channel) {
+    if (channel && !acerhdf_has_gpu_fan())
         return 0;
 
-    err = acerhdf_get_temp(&samples[current_sample]);
-    current_sample++;
-    if (current_sample > TEMPERATURE_SAMPLES - 1) {
-        current_sample = 0;
-    }
-    if (err) {
-        pr_err("error reading temperature, hand off control to BIOS\n");
-        goto err_out;
-    }
-    cur_temp = 0;
-    for (i = 0; i < TEMPERATURE_SAMPLES; i++) {
-        cur_temp+= samples[i];
+    switch (type) {
+    case hwmon_chip:
+        return attr == hwmon_chip_update_interval ? 0444 : 0;
+    case hwmon_temp:
+        return 0444;
+    case hwmon_pwm:
+        if (attr == hwmon_pwm_input)
+            return channel ? 0444 : 0644;
+        return 0644;
+    default:
+        return 0;
     }
-    cur_temp = cur_temp/TEMPERATURE_SAMPLES;
+}
 
+static int acerhdf_hwmon_read(struct device *dev,
+        enum hwmon_sensor_types type, u32 attr, int channel, long *val) {
+    int err, state;
 
-    err = acerhdf_get_fanstate(&cur_state);
-    if (err) {
-        pr_err("error reading fan state, hand off control to BIOS\n");
-        goto err_out;
-    }
-    if (fan_speed_debug) {
-        pr_notice("AVG Temperature: %i\n", cur_temp);
+    switch (type) {
+    case hwmon_chip:
+        *val = READ_ONCE(poll_delay_ms);
+        return 0;
+    case hwmon_temp:
+        if (channel) {
+            *val = gpu_fan.temp;
+            return 0;
+        }
+        return acerhdf_hwmon_temp(val);
+    case hwmon_pwm:
+        if (attr == hwmon_pwm_enable) {
+            *val = !kernelmode ? 3 : READ_ONCE(manual_state) >= 0 ? 1 : 2;
+            return 0;
+        }
+        if (channel) {
+            *val = acerhdf_state_to_pwm(gpu_fan.written);
+            return 0;
+        }
+        err = acerhdf_fan_snapshot(&state);
+        if (err)
+            return err;
+        *val = acerhdf_state_to_pwm(state);
+        return 0;
+    default:
+        return -EOPNOTSUPP;
     }
+}
 
-    if (cur_temp < 40) {
-        state = 3;
-    } else if (cur_temp < 45) {
-        state = 4;
-    } else if (cur_temp < 48) {
-        state = 5;
-    } else if (cur_temp < 50) {
-        state = 6;
-    } else if (cur_temp < 55) {
-        state = 7;
-    } else if (cur_temp < 60) {
-        state = 8;
-    } else if (cur_temp < 65) {
-        state = 9;
-    } else if (cur_temp < 70) {
-        state = 10;
-    } else {
-        state = 11;
+static int acerhdf_hwmon_read_string(struct device *dev,
+        enum hwmon_sensor_types type, u32 attr, int channel,
+        const char **str) {
+    *str = channel ? "gpu" : "cpu";
+    return 0;
+}
+
+static int acerhdf_hwmon_write(struct device *dev,
+        enum hwmon_sensor_types type, u32 attr, int channel, long val) {
+    int state;
+
+    if (type != hwmon_pwm || channel)
+        return -EOPNOTSUPP;
+
+    if (attr == hwmon_pwm_input) {
+        if (READ_ONCE(manual_state) < 0)
+            return -EBUSY;
+        if (val < 0 || val > 255)
+            return -EINVAL;
+        state = DIV_ROUND_CLOSEST(val * ACERHDF_MAX_STATE, 255);
+        WRITE_ONCE(manual_state, max(state, MIN_FAN_SPEED));
+        acerhdf_hwmon_kick();
+        return 0;
     }
-    if(state < MIN_FAN_SPEED){
-        state = MIN_FAN_SPEED;
+
+    switch (val) {
+    case 1:
+        /* start manual mode from the current state */
+        acerhdf_change_mode(true);
+        WRITE_ONCE(manual_state, clamp(fan_written, MIN_FAN_SPEED,
+                ACERHDF_MAX_STATE));
+        break;
+    case 2:
+        WRITE_ONCE(manual_state, -1);
+        acerhdf_change_mode(true);
+        break;
+    case 3:
+        WRITE_ONCE(manual_state, -1);
+        acerhdf_change_mode(false);
+        return 0;
+    default:
+        return -EINVAL;
     }
-    acerhdf_change_fanstate((int) state);
-    return 0;
+    acerhdf_hwmon_kick();
 
-err_out:
-    acerhdf_revert_to_bios_mode();
-    return -EINVAL;
+    return 0;
 }
 
-/* bind fan callbacks to fan device */
-static const struct thermal_cooling_device_ops acerhdf_cooling_ops = {
-    .get_max_state = acerhdf_get_max_state,
-    .get_cur_state = acerhdf_get_cur_state,
-    .set_cur_state = acerhdf_set_cur_state,
+static const u32 acerhdf_chip_config[] = {
+    HWMON_C_UPDATE_INTERVAL,
+    0
 };
 
-/* suspend / resume functionality */
-static int acerhdf_suspend(struct device *dev) {
-    if (kernelmode)
-        acerhdf_change_fanstate(5);
+static const struct hwmon_channel_info acerhdf_chip = {
+    .type = hwmon_chip,
+    .config = acerhdf_chip_config,
+};
 
-    if (verbose)
-        pr_notice("going suspend\n");
+static const u32 acerhdf_temp_config[] = {
+    HWMON_T_INPUT | HWMON_T_LABEL,
+    HWMON_T_INPUT | HWMON_T_LABEL,
+    0
+};
 
-    return 0;
+static const struct hwmon_channel_info acerhdf_temp = {
+    .type = hwmon_temp,
+    .config = acerhdf_temp_config,
+};
+
+static const u32 acerhdf_pwm_config[] = {
+    HWMON_PWM_INPUT | HWMON_PWM_ENABLE,
+    HWMON_PWM_INPUT,
+    0
+};
+
+static const struct hwmon_channel_info acerhdf_pwm = {
+    .type = hwmon_pwm,
+    .config = acerhdf_pwm_config,
+};
+
+static const struct hwmon_channel_info *acerhdf_hwmon_info[] = {
+    &acerhdf_chip,
+    &acerhdf_temp,
+    &acerhdf_pwm,
+    NULL
+};
+
+static const struct hwmon_ops acerhdf_hwmon_ops = {
+    .is_visible = acerhdf_hwmon_is_visible,
+    .read = acerhdf_hwmon_read,
+    .read_string = acerhdf_hwmon_read_string,
+    .write = acerhdf_hwmon_write,
+};
+
+static const struct hwmon_chip_info acerhdf_chip_info = {
+    .ops = &acerhdf_hwmon_ops,
+    .info = acerhdf_hwmon_info,
+};
+
+/* monitoring is optional, the driver works without it */
+static void __init acerhdf_hwmon_init(void) {
+    acerhdf_hwmon = hwmon_device_register_with_info(&acerhdf_dev->dev,
+            "acerhdf", NULL, &acerhdf_chip_info, NULL);
+    if (IS_ERR(acerhdf_hwmon)) {
+        pr_warn("hwmon registration failed: %ld\n", PTR_ERR(acerhdf_hwmon));
+        acerhdf_hwmon = NULL;
+    }
+}
+
+static void acerhdf_hwmon_exit(void) {
+    if (acerhdf_hwmon)
+        hwmon_device_unregister(acerhdf_hwmon);
+    acerhdf_hwmon = NULL;
 }
 
 static int acerhdf_probe(struct platform_device *device) {
@@ -512,7 +3396,11 @@ static int acerhdf_remove(struct platform_device *device) {
 
 static const struct dev_pm_ops acerhdf_pm_ops = {
     .suspend = acerhdf_suspend,
+    .resume = acerhdf_resume,
     .freeze = acerhdf_suspend,
+    .thaw = acerhdf_resume,
+    .poweroff = acerhdf_suspend,
+    .restore = acerhdf_resume,
 };
 
 static struct platform_driver acerhdf_driver = {
@@ -580,12 +3468,10 @@ static int __init acerhdf_check_hardware(void) {
         kernelmode = 0;
     }
 
-    if (verbose)
+    if (acerhdf_verbose())
         pr_info("BIOS info: %s %s, product: %s\n",
             vendor, version, product);
 
-    memset(samples, 0, TEMPERATURE_SAMPLES * sizeof (int));
-
     /* search BIOS version and vendor in BIOS settings table */
     for (bt = bios_tbl; bt->vendor[0]; bt++) {
         /*
@@ -611,6 +3497,14 @@ static int __init acerhdf_check_hardware(void) {
     ctrl_cfg.tempreg = bt->tempreg;
     memcpy(&ctrl_cfg.cmd, &bt->cmd, sizeof (struct fancmd));
     ctrl_cfg.mcmd_enable = bt->mcmd_enable;
+    if (gpu_fanreg > U8_MAX || gpu_tempreg > U8_MAX) {
+        pr_err("invalid GPU fan registers\n");
+        return -EINVAL;
+    }
+    ctrl_cfg.gpu_fanreg = gpu_fanreg ? gpu_fanreg : bt->gpu_fanreg;
+    ctrl_cfg.gpu_tempreg = gpu_tempreg ? gpu_tempreg : bt->gpu_tempreg;
+    if (bt->inputs && !extra_inputs_set && acerhdf_load_inputs(bt->inputs))
+        pr_err("invalid model inputs \"%s\"\n", bt->inputs);
 
     /*
      * if started with kernel mode off, prevent the kernel from switching
@@ -636,6 +3530,7 @@ static int __init acerhdf_register_platform(void) {
         err = -ENOMEM;
         goto err_device_alloc;
     }
+    acerhdf_dev->dev.groups = acerhdf_groups;
     err = platform_device_add(acerhdf_dev);
     if (err)
         goto err_device_add;
@@ -664,7 +3559,7 @@ static int __init acerhdf_register_thermal(void) {
     thz_dev = thermal_zone_device_register("acerhdf", 2, 0, NULL,
             &acerhdf_dev_ops,
             &acerhdf_zone_params, 0,
-            (kernelmode) ? interval * 1000 : 0);
+            (kernelmode) ? acerhdf_config_get(interval) * 1000 : 0);
     if (IS_ERR(thz_dev))
         return -EINVAL;
 
@@ -678,7 +3573,40 @@ static int __init acerhdf_register_thermal(void) {
     return 0;
 }
 
+/* the GPU zone isn't polled, its temperature comes from the control cycle */
+static int __init acerhdf_register_gpu(void) {
+    if (!acerhdf_has_gpu_fan())
+        return 0;
+
+    gpu_cl_dev = thermal_cooling_device_register("acerhdf-gpu-fan", NULL,
+            &acerhdf_gpu_cooling_ops);
+    if (IS_ERR(gpu_cl_dev)) {
+        gpu_cl_dev = NULL;
+        return -EINVAL;
+    }
+
+    gpu_thz_dev = thermal_zone_device_register("acerhdf-gpu", 0, 0, NULL,
+            &acerhdf_gpu_dev_ops, NULL, 0, 0);
+    if (IS_ERR(gpu_thz_dev)) {
+        gpu_thz_dev = NULL;
+        return -EINVAL;
+    }
+
+    pr_info("GPU fan at EC register 0x%02x\n", ctrl_cfg.gpu_fanreg);
+    return 0;
+}
+
 static void acerhdf_unregister_thermal(void) {
+    if (gpu_cl_dev) {
+        thermal_cooling_device_unregister(gpu_cl_dev);
+        gpu_cl_dev = NULL;
+    }
+
+    if (gpu_thz_dev) {
+        thermal_zone_device_unregister(gpu_thz_dev);
+        gpu_thz_dev = NULL;
+    }
+
     if (cl_dev) {
         thermal_cooling_device_unregister(cl_dev);
         cl_dev = NULL;
@@ -693,32 +3621,94 @@ static void acerhdf_unregister_thermal(void) {
 static int __init acerhdf_init(void) {
     int err = 0;
 
+    /* compile-time defaults of the debug switches */
+    if (fan_speed_debug)
+        static_branch_enable(&acerhdf_debug_key);
+    if (verbose)
+        static_branch_enable(&acerhdf_verbose_key);
+
+    hrtimer_init(&control.timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    control.timer.function = acerhdf_control_timer;
+    INIT_WORK(&control.work, acerhdf_control_work);
+    INIT_WORK(&ec_async.work, acerhdf_ec_async_work);
+    init_completion(&ec_async.done);
+    acerhdf_check_config();
+
     err = acerhdf_check_hardware();
     if (err)
-        goto out_err;
+        goto err_curve;
+    acerhdf_ec_benchmark();
+
+    /* unless a curve was given at load time */
+    if (!rcu_access_pointer(fan_curve)) {
+        err = acerhdf_load_curve(&fan_curve, ACERHDF_DEFAULT_CURVE);
+        if (err)
+            goto err_curve;
+    }
+    if (!rcu_access_pointer(power_curve)) {
+        err = acerhdf_load_curve(&power_curve, ACERHDF_DEFAULT_POWER_CURVE);
+        if (err)
+            goto err_curve;
+    }
+    if (!rcu_access_pointer(gpu_curve)) {
+        err = acerhdf_load_curve(&gpu_curve, ACERHDF_DEFAULT_GPU_CURVE);
+        if (err)
+            goto err_curve;
+    }
+    acerhdf_rapl_probe();
+    acerhdf_dts_probe();
+    acerhdf_warm_start();
 
     err = acerhdf_register_platform();
     if (err)
-        goto out_err;
+        goto err_curve;
 
     err = acerhdf_register_thermal();
     if (err)
         goto err_unreg;
 
+    err = acerhdf_register_gpu();
+    if (err)
+        goto err_unreg;
+
+    acerhdf_debugfs_init();
+    acerhdf_hwmon_init();
+    acerhdf_ring_init();
+    if (kernelmode)
+        acerhdf_control_start();
+
     return 0;
 
 err_unreg:
     acerhdf_unregister_thermal();
     acerhdf_unregister_platform();
-
-out_err:
+err_curve:
+    cancel_work_sync(&ec_async.work);
+    cancel_work_sync(&acerhdf_inputs_update);
+    acerhdf_free_curve(&gpu_curve);
+    acerhdf_free_curve(&power_curve);
+    acerhdf_free_curve(&fan_curve);
+    acerhdf_free_config();
     return err;
 }
 
 static void __exit acerhdf_exit(void) {
+    acerhdf_hwmon_exit();
+    acerhdf_debugfs_exit();
+    acerhdf_control_stop();
+    cancel_work_sync(&control.work);
     acerhdf_change_fanstate(5);
+    acerhdf_gpu_release();
     acerhdf_unregister_thermal();
     acerhdf_unregister_platform();
+    /* nothing samples any more, so nothing requeues these */
+    cancel_work_sync(&ec_async.work);
+    cancel_work_sync(&acerhdf_inputs_update);
+    acerhdf_ring_exit();
+    acerhdf_free_curve(&gpu_curve);
+    acerhdf_free_curve(&power_curve);
+    acerhdf_free_curve(&fan_curve);
+    acerhdf_free_config();
 }
 
 MODULE_LICENSE("GPL");
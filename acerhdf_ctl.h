@@ -0,0 +1,521 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * Pure control logic of acerhdf: temperature filters, fan curve compilation
+ * and lookup with the MIN_FAN_SPEED clamp, output shaping and the emergency
+ * bypass. Nothing in here touches the EC, locks or module parameters, so the
+ * same code is built into the module and into the userspace replay tool
+ * (tools/acerhdf_replay.c), which includes tools/acerhdf_user.h before this
+ * header.
+ *
+ * Temperatures are millidegrees Celsius for the filters and whole degrees
+ * for the curve, times are milliseconds.
+ */
+#ifndef _ACERHDF_CTL_H
+#define _ACERHDF_CTL_H
+
+#ifdef __KERNEL__
+#include <linux/kernel.h>
+#include <linux/math64.h>
+#include <linux/rcupdate.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#endif
+
+//*****************Predator settings *******************************************
+//Default filter window in samples, one sample per poll
+#define TEMPERATURE_SAMPLES  10
+
+//Minimal allowed Fan speed
+#define MIN_FAN_SPEED 4
+
+//Highest fan state accepted by the EC
+#define ACERHDF_MAX_STATE 11
+
+/*
+ * Default fan curve, "temperature:state" points, each state applies from its
+ * temperature up to the next point. Can be replaced at runtime through the
+ * curve module parameter.
+ */
+#define ACERHDF_DEFAULT_CURVE "0:3,40:4,45:5,48:6,50:7,55:8,60:9,65:10,70:11"
+//******************************************************************************
+
+/*
+ * Temperature filters. They work in millidegrees Celsius, are fed one EC
+ * sample per poll cycle and are selected at runtime through the filter
+ * module parameter:
+ *  box    - running-sum average over the last filter_window samples
+ *  ema    - exponential moving average, new sample weighted filter_alpha/256
+ *  median - median of the last filter_window samples, rejects glitches
+ *  twa    - time-weighted average over the last filter_span ms, stays
+ *           correct when the polling interval changes; samples closer than
+ *           filter_span / 31 are merged into one slot, so the ring always
+ *           covers the whole span
+ */
+#define ACERHDF_FILTER_MAX_WINDOW 32
+#define ACERHDF_EMA_SHIFT 8
+
+enum acerhdf_filter_type {
+    ACERHDF_FILTER_BOX,
+    ACERHDF_FILTER_EMA,
+    ACERHDF_FILTER_MEDIAN,
+    ACERHDF_FILTER_TWA,
+};
+
+/* tunables, the module fills this from its parameters for every call */
+struct acerhdf_filter_cfg {
+    unsigned int window;   /* box and median, samples */
+    unsigned int alpha;    /* ema, n/256 */
+    unsigned int span;     /* twa, ms */
+    unsigned int period;   /* expected time between samples, ms */
+};
+
+struct acerhdf_filter {
+    int ring[ACERHDF_FILTER_MAX_WINDOW];
+    unsigned int dt[ACERHDF_FILTER_MAX_WINDOW];
+    unsigned int head;
+    unsigned int count;
+    s64 sum;
+    unsigned int span;
+    s64 ema;
+    unsigned int last;
+    unsigned int seq;
+    int out;
+};
+
+struct acerhdf_filter_ops {
+    const char *name;
+    int (*update)(struct acerhdf_filter *f,
+            const struct acerhdf_filter_cfg *cfg, int temp, unsigned int now);
+    void (*prefill)(struct acerhdf_filter *f,
+            const struct acerhdf_filter_cfg *cfg, int temp, unsigned int now);
+};
+
+static inline void acerhdf_filter_reset(struct acerhdf_filter *f) {
+    memset(f, 0, sizeof (*f));
+}
+
+/* store temp in the ring, evicting the oldest sample once it is full */
+static inline void acerhdf_filter_store(struct acerhdf_filter *f, int temp,
+        unsigned int window) {
+    if (f->count >= window)
+        f->sum -= f->ring[f->head];
+    else
+        f->count++;
+
+    f->ring[f->head] = temp;
+    f->sum += temp;
+    f->head = (f->head + 1) % window;
+}
+
+static inline int acerhdf_filter_box(struct acerhdf_filter *f,
+        const struct acerhdf_filter_cfg *cfg, int temp, unsigned int now) {
+    acerhdf_filter_store(f, temp, cfg->window);
+
+    return div_s64(f->sum, f->count);
+}
+
+static inline int acerhdf_filter_ema(struct acerhdf_filter *f,
+        const struct acerhdf_filter_cfg *cfg, int temp, unsigned int now) {
+    s64 target = (s64) temp << ACERHDF_EMA_SHIFT;
+
+    if (!f->count) {
+        f->ema = target;
+        f->count = 1;
+    } else {
+        f->ema += ((target - f->ema) * cfg->alpha) >> 8;
+    }
+
+    return (f->ema + (1 << (ACERHDF_EMA_SHIFT - 1))) >> ACERHDF_EMA_SHIFT;
+}
+
+static inline int acerhdf_filter_median(struct acerhdf_filter *f,
+        const struct acerhdf_filter_cfg *cfg, int temp, unsigned int now) {
+    int sorted[ACERHDF_FILTER_MAX_WINDOW];
+    unsigned int i, j;
+
+    acerhdf_filter_store(f, temp, cfg->window);
+
+    /* insertion sort, the window is tiny */
+    for (i = 0; i < f->count; i++) {
+        int v = f->ring[i];
+
+        for (j = i; j > 0 && sorted[j - 1] > v; j--)
+            sorted[j] = sorted[j - 1];
+        sorted[j] = v;
+    }
+
+    if (f->count & 1)
+        return sorted[f->count / 2];
+    return (sorted[f->count / 2 - 1] + sorted[f->count / 2]) / 2;
+}
+
+static inline int acerhdf_filter_twa(struct acerhdf_filter *f,
+        const struct acerhdf_filter_cfg *cfg, int temp, unsigned int now) {
+    unsigned int horizon = max_t(unsigned int, cfg->span, 1);
+    unsigned int bucket = DIV_ROUND_UP(horizon, ACERHDF_FILTER_MAX_WINDOW - 1);
+    unsigned int dt;
+    unsigned int oldest;
+    unsigned int newest;
+
+    /* each sample stands for the time since the previous one */
+    if (f->count)
+        dt = now - f->last;
+    else
+        dt = cfg->period;
+    dt = clamp_t(unsigned int, dt, 1, horizon);
+    f->last = now;
+
+    /*
+     * merge into the newest slot until it spans a whole bucket, every full
+     * slot then covers at least span / 31 and 32 of them the whole span
+     */
+    newest = (f->head + ACERHDF_FILTER_MAX_WINDOW - 1) %
+            ACERHDF_FILTER_MAX_WINDOW;
+    if (f->count && f->dt[newest] < bucket) {
+        f->sum -= (s64) f->ring[newest] * f->dt[newest];
+        f->ring[newest] = div_s64((s64) f->ring[newest] * f->dt[newest] +
+                (s64) temp * dt, f->dt[newest] + dt);
+        f->dt[newest] += dt;
+        f->sum += (s64) f->ring[newest] * f->dt[newest];
+        f->span += dt;
+        goto trim;
+    }
+
+    if (f->count == ACERHDF_FILTER_MAX_WINDOW) {
+        oldest = f->head;
+        f->sum -= (s64) f->ring[oldest] * f->dt[oldest];
+        f->span -= f->dt[oldest];
+        f->count--;
+    }
+    f->ring[f->head] = temp;
+    f->dt[f->head] = dt;
+    f->sum += (s64) temp * dt;
+    f->span += dt;
+    f->head = (f->head + 1) % ACERHDF_FILTER_MAX_WINDOW;
+    f->count++;
+
+trim:
+    /* drop samples which fell out of the horizon */
+    for (;;) {
+        oldest = (f->head + ACERHDF_FILTER_MAX_WINDOW - f->count) %
+                ACERHDF_FILTER_MAX_WINDOW;
+        if (f->count == 1 || f->span - f->dt[oldest] < horizon)
+            break;
+        f->sum -= (s64) f->ring[oldest] * f->dt[oldest];
+        f->span -= f->dt[oldest];
+        f->count--;
+    }
+
+    return div_s64(f->sum, f->span);
+}
+
+/* prefill: the filter state as if temp had been steady for a full window */
+static inline void acerhdf_prefill_window(struct acerhdf_filter *f,
+        const struct acerhdf_filter_cfg *cfg, int temp, unsigned int now) {
+    unsigned int i;
+
+    for (i = 0; i < cfg->window; i++)
+        f->ring[i] = temp;
+    f->count = cfg->window;
+    f->sum = (s64) temp * cfg->window;
+}
+
+static inline void acerhdf_prefill_ema(struct acerhdf_filter *f,
+        const struct acerhdf_filter_cfg *cfg, int temp, unsigned int now) {
+    f->ema = (s64) temp << ACERHDF_EMA_SHIFT;
+    f->count = 1;
+}
+
+static inline void acerhdf_prefill_twa(struct acerhdf_filter *f,
+        const struct acerhdf_filter_cfg *cfg, int temp, unsigned int now) {
+    unsigned int horizon = max_t(unsigned int, cfg->span, 1);
+
+    f->ring[0] = temp;
+    f->dt[0] = horizon;
+    f->sum = (s64) temp * horizon;
+    f->span = horizon;
+    f->head = 1;
+    f->count = 1;
+    f->last = now;
+}
+
+static const struct acerhdf_filter_ops acerhdf_filters[] = {
+    [ACERHDF_FILTER_BOX] = {
+        "box", acerhdf_filter_box, acerhdf_prefill_window
+    },
+    [ACERHDF_FILTER_EMA] = {
+        "ema", acerhdf_filter_ema, acerhdf_prefill_ema
+    },
+    [ACERHDF_FILTER_MEDIAN] = {
+        "median", acerhdf_filter_median, acerhdf_prefill_window
+    },
+    [ACERHDF_FILTER_TWA] = {
+        "twa", acerhdf_filter_twa, acerhdf_prefill_twa
+    },
+};
+
+/*
+ * Fan curve, compiled from its points into a table indexed by the EC
+ * temperature so the control loop does a single array load. The module
+ * publishes a new curve with an RCU pointer swap. The power feed-forward
+ * curve uses the same format with watts as input.
+ *
+ * A point may carry a third field, "input:state:hyst": once in that state,
+ * the input has to drop hyst below the point before the curve steps down
+ * again. A second table holds the states for these falling thresholds.
+ */
+#define ACERHDF_CURVE_MAX_POINTS 16
+
+struct acerhdf_curve {
+#ifdef __KERNEL__
+    struct rcu_head rcu;
+#endif
+    unsigned int npoints;
+    u8 input[ACERHDF_CURVE_MAX_POINTS];
+    u8 state[ACERHDF_CURVE_MAX_POINTS];
+    u8 hyst[ACERHDF_CURVE_MAX_POINTS];
+    u8 table[U8_MAX + 1];
+    u8 falling[U8_MAX + 1];
+    u8 rise[U8_MAX + 1];
+    u8 fall[U8_MAX + 1];
+};
+
+/* c must be zeroed */
+static inline int acerhdf_parse_curve(const char *val,
+        struct acerhdf_curve *c) {
+    char *buf, *p, *tok, *field;
+    unsigned int input, state, hyst;
+    int err = 0;
+
+    buf = kstrdup(val, GFP_KERNEL);
+    if (!buf)
+        return -ENOMEM;
+
+    p = buf;
+    while ((tok = strsep(&p, ", \t\n"))) {
+        if (!*tok)
+            continue;
+
+        hyst = 0;
+        field = strsep(&tok, ":");
+        if (!tok || kstrtouint(field, 10, &input)) {
+            err = -EINVAL;
+            break;
+        }
+        field = strsep(&tok, ":");
+        if (kstrtouint(field, 10, &state) ||
+                (tok && kstrtouint(tok, 10, &hyst))) {
+            err = -EINVAL;
+            break;
+        }
+        if (input > U8_MAX || state > ACERHDF_MAX_STATE ||
+                c->npoints == ACERHDF_CURVE_MAX_POINTS) {
+            err = -EINVAL;
+            break;
+        }
+        /* the falling threshold must stay above the previous point */
+        if (c->npoints && (input <= c->input[c->npoints - 1] ||
+                hyst >= input - c->input[c->npoints - 1])) {
+            err = -EINVAL;
+            break;
+        }
+        c->input[c->npoints] = input;
+        c->state[c->npoints] = state;
+        c->hyst[c->npoints] = c->npoints ? hyst : 0;
+        c->npoints++;
+    }
+    kfree(buf);
+
+    if (!err && !c->npoints)
+        err = -EINVAL;
+
+    return err;
+}
+
+/* below the first point its state applies, MIN_FAN_SPEED is enforced here */
+static inline void acerhdf_compile_curve(struct acerhdf_curve *c) {
+    unsigned int t, i = 0;
+    u8 state;
+
+    for (t = 0; t <= U8_MAX; t++) {
+        while (i + 1 < c->npoints && t >= c->input[i + 1])
+            i++;
+        state = c->state[i];
+        c->table[t] = max_t(u8, state, MIN_FAN_SPEED);
+    }
+
+    for (t = 0, i = 0; t <= U8_MAX; t++) {
+        while (i + 1 < c->npoints &&
+                t >= c->input[i + 1] - c->hyst[i + 1])
+            i++;
+        state = c->state[i];
+        c->falling[t] = max_t(u8, state, MIN_FAN_SPEED);
+    }
+
+    /*
+     * degrees to the next step up, and down past the falling threshold,
+     * for adaptive polling
+     */
+    c->rise[U8_MAX] = U8_MAX;
+    for (t = U8_MAX; t-- > 0;) {
+        if (c->table[t + 1] != c->table[t])
+            c->rise[t] = 1;
+        else
+            c->rise[t] = min_t(int, c->rise[t + 1] + 1, U8_MAX);
+    }
+    for (t = 0; t <= U8_MAX; t++) {
+        for (i = 1; i <= t && c->falling[t - i] >= c->table[t]; i++)
+            ;
+        c->fall[t] = i <= t ? i : U8_MAX;
+    }
+}
+
+/*
+ * cur is the state this curve produced last time, -1 if none: step up on
+ * the rising thresholds, step down only past the falling ones
+ */
+static inline int acerhdf_curve_lookup(const struct acerhdf_curve *c,
+        int input, int *cur) {
+    int state = *cur;
+    int rising, falling;
+
+    input = clamp_t(int, input, 0, U8_MAX);
+    rising = c->table[input];
+    falling = c->falling[input];
+
+    if (state < 0 || rising > state)
+        state = rising;
+    else if (falling < state)
+        state = falling;
+
+    *cur = state;
+    return state;
+}
+
+/*
+ * Time-domain output shaping: the controller output is slew limited to
+ * ramp_up / ramp_down states per second (0 = unlimited) and a state is held
+ * at least down_dwell_ms before stepping down. This keeps short load bursts
+ * from cycling the fan motor without delaying the reaction to real heat.
+ */
+#define ACERHDF_DEFAULT_RAMP_UP 0
+#define ACERHDF_DEFAULT_RAMP_DOWN 1
+#define ACERHDF_DEFAULT_DOWN_DWELL_MS 5000
+
+struct acerhdf_shape_cfg {
+    unsigned int ramp_up;
+    unsigned int ramp_down;
+    unsigned int down_dwell_ms;
+};
+
+/* out is -1 until the first state */
+struct acerhdf_shape {
+    int out;
+    unsigned int changed_at;
+    unsigned int last_step;
+};
+
+/* steps the rate allows since the last step, rate in states per second */
+static inline int acerhdf_shape_steps(const struct acerhdf_shape *s,
+        unsigned int rate, unsigned int now) {
+    if (!rate)
+        return ACERHDF_MAX_STATE;
+
+    return rate * (now - s->last_step) / 1000;
+}
+
+static inline int acerhdf_shape_step(struct acerhdf_shape *s,
+        const struct acerhdf_shape_cfg *cfg, int target, unsigned int now) {
+    int out = s->out, steps;
+
+    if (out < 0) {
+        out = target;
+    } else if (target > out) {
+        steps = acerhdf_shape_steps(s, cfg->ramp_up, now);
+        out = min_t(int, target, out + steps);
+    } else if (target < out) {
+        if (now - s->changed_at < cfg->down_dwell_ms) {
+            /* the ramp down budget starts once the dwell time is over */
+            s->last_step = now;
+            return out;
+        }
+        steps = acerhdf_shape_steps(s, cfg->ramp_down, now);
+        out = max_t(int, target, out - steps);
+    } else {
+        /* on target, a later ramp starts with a fresh budget */
+        s->last_step = now;
+    }
+
+    if (out != s->out) {
+        s->out = out;
+        s->changed_at = now;
+        s->last_step = now;
+    }
+
+    return out;
+}
+
+/* the output was set past the shaping, ramp down from it like from any other */
+static inline void acerhdf_shape_hold(struct acerhdf_shape *s, int state,
+        unsigned int now) {
+    s->out = state;
+    s->changed_at = now;
+}
+
+/*
+ * Emergency bypass. The filters deliberately lag, so a raw sample at or above
+ * emergency_temp, or rising faster than emergency_rate degrees per second,
+ * commands the maximum state at once, past filter and output shaping. The
+ * bypass stays on until the raw temperature is below emergency_temp again
+ * and the filtered one has caught up with it. The rise rate is taken over
+ * at least one second so fast polling doesn't trip it on a single degree
+ * step.
+ */
+#define ACERHDF_DEFAULT_EMERGENCY_TEMP 85
+#define ACERHDF_DEFAULT_EMERGENCY_RATE 10
+
+struct acerhdf_emergency_cfg {
+    unsigned int temp;     /* degrees */
+    unsigned int rate;     /* degrees per second, 0 = off */
+};
+
+struct acerhdf_emergency_ctl {
+    bool primed;
+    bool boosted;
+    int ref_temp;
+    unsigned int ref;
+};
+
+/* temperatures in millidegrees, returns true while boosted */
+static inline bool acerhdf_emergency_update(struct acerhdf_emergency_ctl *e,
+        const struct acerhdf_emergency_cfg *cfg, int raw, int filtered,
+        unsigned int now) {
+    unsigned int dt = now - e->ref;
+    bool spike;
+
+    if (!e->primed) {
+        e->primed = true;
+        e->ref_temp = raw;
+        e->ref = now;
+        dt = 0;
+    }
+
+    spike = raw >= (int) cfg->temp * 1000;
+    if (cfg->rate && raw > e->ref_temp)
+        spike |= (s64) (raw - e->ref_temp) * 1000 >=
+                (s64) cfg->rate * 1000 * max_t(unsigned int, dt, 1000);
+
+    if (dt >= 1000) {
+        e->ref_temp = raw;
+        e->ref = now;
+    }
+
+    if (spike)
+        e->boosted = true;
+    else if (e->boosted && filtered >= raw - 1000)
+        e->boosted = false;
+
+    return e->boosted;
+}
+
+#endif /* _ACERHDF_CTL_H */
@@ -0,0 +1,55 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later WITH Linux-syscall-note */
+/*
+ * Layout of the acerhdf telemetry ring, shared by the driver and userspace.
+ *
+ * /dev/acerhdf is mmap()ed read-only. The mapping starts with struct
+ * acerhdf_ring_header, the records follow at header.offset. The driver
+ * appends one record per control cycle at index head % size and then
+ * advances head; it never waits for readers.
+ *
+ * A reader keeps its own tail:
+ *
+ *    head = __atomic_load_n(&hdr->head, __ATOMIC_ACQUIRE);
+ *    if (head - tail > hdr->size)
+ *        lost += head - tail - hdr->size, tail = head - hdr->size;
+ *    while (tail < head) {
+ *        rec = &recs[tail % hdr->size];
+ *        s = __atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE);
+ *        copy = *rec;
+ *        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+ *        if (s != tail + 1 || __atomic_load_n(&rec->seq,
+ *                __ATOMIC_RELAXED) != s)
+ *            lost++;        (overwritten while copying)
+ *        tail++;
+ *    }
+ */
+#ifndef _ACERHDF_RING_H
+#define _ACERHDF_RING_H
+
+#include <linux/types.h>
+
+#define ACERHDF_RING_MAGIC 0x61636872 /* "achr" */
+#define ACERHDF_RING_VERSION 1
+
+struct acerhdf_ring_header {
+    __u32 magic;
+    __u32 version;
+    __u32 size;            /* records, a power of two */
+    __u32 record_size;
+    __u32 offset;          /* of the first record from the mapping start */
+    __u32 pad;
+    __u64 head;            /* records appended so far */
+};
+
+struct acerhdf_ring_record {
+    __u64 seq;             /* index + 1 when complete, 0 while written */
+    __u64 time_ns;         /* CLOCK_MONOTONIC */
+    __u32 sample;          /* sample sequence number */
+    __s32 raw;             /* control input, millidegrees */
+    __s32 filtered;        /* millidegrees */
+    __s32 state;           /* fan state chosen by the controller */
+    __s32 written;         /* fan state in the EC, -1 if unknown */
+    __u32 ec_latency_ns;   /* EC window of this cycle */
+};
+
+#endif /* _ACERHDF_RING_H */
@@ -0,0 +1,116 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * acerhdf tracepoints, one per control loop stage:
+ *
+ *  acerhdf_sample    - every new EC sample, raw and filtered
+ *  acerhdf_fan_state - every computed fan state and whether it was written
+ *  acerhdf_ec_access - every EC register access with its latency
+ *  acerhdf_mode      - switches between kernel and BIOS fan control
+ *
+ * e.g. trace-cmd record -e acerhdf -e power -e sched
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM acerhdf
+
+#if !defined(_ACERHDF_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _ACERHDF_TRACE_H
+
+#include <linux/tracepoint.h>
+
+TRACE_EVENT(acerhdf_sample,
+
+    TP_PROTO(unsigned int seq, int raw, int filtered),
+
+    TP_ARGS(seq, raw, filtered),
+
+    TP_STRUCT__entry(
+        __field(unsigned int, seq)
+        __field(int, raw)
+        __field(int, filtered)
+    ),
+
+    TP_fast_assign(
+        __entry->seq = seq;
+        __entry->raw = raw;
+        __entry->filtered = filtered;
+    ),
+
+    TP_printk("seq=%u raw=%d filtered=%d",
+        __entry->seq, __entry->raw, __entry->filtered)
+);
+
+TRACE_EVENT(acerhdf_fan_state,
+
+    TP_PROTO(int state, int written, bool elided),
+
+    TP_ARGS(state, written, elided),
+
+    TP_STRUCT__entry(
+        __field(int, state)
+        __field(int, written)
+        __field(bool, elided)
+    ),
+
+    TP_fast_assign(
+        __entry->state = state;
+        __entry->written = written;
+        __entry->elided = elided;
+    ),
+
+    TP_printk("state=%d written=%d elided=%d",
+        __entry->state, __entry->written, __entry->elided)
+);
+
+TRACE_EVENT(acerhdf_ec_access,
+
+    TP_PROTO(u8 reg, u8 val, bool write, int err, s64 latency_ns),
+
+    TP_ARGS(reg, val, write, err, latency_ns),
+
+    TP_STRUCT__entry(
+        __field(u8, reg)
+        __field(u8, val)
+        __field(bool, write)
+        __field(int, err)
+        __field(s64, latency_ns)
+    ),
+
+    TP_fast_assign(
+        __entry->reg = reg;
+        __entry->val = val;
+        __entry->write = write;
+        __entry->err = err;
+        __entry->latency_ns = latency_ns;
+    ),
+
+    TP_printk("%s reg=0x%02x val=0x%02x err=%d latency=%lldns",
+        __entry->write ? "write" : "read", __entry->reg, __entry->val,
+        __entry->err, __entry->latency_ns)
+);
+
+TRACE_EVENT(acerhdf_mode,
+
+    TP_PROTO(bool kernelmode),
+
+    TP_ARGS(kernelmode),
+
+    TP_STRUCT__entry(
+        __field(bool, kernelmode)
+    ),
+
+    TP_fast_assign(
+        __entry->kernelmode = kernelmode;
+    ),
+
+    TP_printk("%s", __entry->kernelmode ? "kernel" : "bios")
+);
+
+#endif /* _ACERHDF_TRACE_H */
+
+/* the header lives next to the driver, not in include/trace/events */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE acerhdf_trace
+
+#include <trace/define_trace.h>
@@ -0,0 +1,458 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * acerhdf_replay - feed a recorded temperature trace through the acerhdf
+ * control logic (acerhdf_ctl.h) in userspace and report what the CPU fan
+ * would have done: time above each threshold, EC writes, state transitions
+ * per hour, emergency entries and the CPU cost of one control step.
+ *
+ * The trace is text, one sample per line, "#" starts a comment:
+ *    <temp>             millidegrees, samples -i seconds apart
+ *    <time_ms> <temp>   millidegrees at a monotonic time in ms
+ * The time and raw columns of the telemetry ring (acerhdf_ring.h) give the
+ * second form after dividing time_ns by 1000000.
+ *
+ * A step runs filter, emergency bypass, curve, output shaping and write
+ * elision in the order acerhdf_control_step does in curve mode. The setpoint
+ * controller, power feed-forward and the GPU fan are not replayed.
+ *
+ * The replay is open loop: the recorded temperatures do not react to the
+ * replayed fan states, so the threshold times describe the trace (raw) and
+ * the filter (filtered), the fan figures describe the curve and shaping.
+ */
+#define _DEFAULT_SOURCE
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "acerhdf_user.h"
+#include "acerhdf_ctl.h"
+
+#define REPLAY_MAX_THRESHOLDS 8
+
+/* Predator PH517-51 fan register, see bios_settings in acerhdf.c */
+#define REPLAY_FANREG 0x4f
+
+/* stub EC: a register file and a transaction count instead of ACPI */
+static u8 ec_regs[U8_MAX + 1];
+static unsigned long ec_writes;
+
+static int ec_write(u8 addr, u8 val) {
+    ec_regs[addr] = val;
+    ec_writes++;
+    return 0;
+}
+
+struct trace {
+    unsigned int *time;
+    int *temp;
+    size_t n;
+    size_t alloc;
+};
+
+struct replay {
+    const struct acerhdf_curve *curve;
+    const struct acerhdf_filter_ops *ops;
+    struct acerhdf_filter_cfg cfg;
+    struct acerhdf_shape_cfg shape_cfg;
+    struct acerhdf_emergency_cfg emergency_cfg;
+    unsigned int refresh;          /* ms, 0 = never */
+    struct acerhdf_filter filter;
+    struct acerhdf_shape shape;
+    struct acerhdf_emergency_ctl emergency;
+    unsigned long emergencies;
+    int curve_out;
+    int written;
+    unsigned int written_at;
+};
+
+static void replay_reset(struct replay *r) {
+    acerhdf_filter_reset(&r->filter);
+    memset(&r->shape, 0, sizeof (r->shape));
+    r->shape.out = -1;
+    memset(&r->emergency, 0, sizeof (r->emergency));
+    r->emergencies = 0;
+    r->curve_out = -1;
+    r->written = -1;
+}
+
+/* one control cycle, acerhdf_control_step in curve mode */
+static int replay_step(struct replay *r, int temp, unsigned int now,
+        int *filtered) {
+    bool boosted = r->emergency.boosted;
+    int state;
+
+    *filtered = r->ops->update(&r->filter, &r->cfg, temp, now);
+
+    if (acerhdf_emergency_update(&r->emergency, &r->emergency_cfg, temp,
+            *filtered, now)) {
+        if (!boosted)
+            r->emergencies++;
+        state = ACERHDF_MAX_STATE;
+        acerhdf_shape_hold(&r->shape, state, now);
+    } else {
+        state = acerhdf_curve_lookup(r->curve, *filtered / 1000,
+                &r->curve_out);
+        state = acerhdf_shape_step(&r->shape, &r->shape_cfg, state, now);
+    }
+
+    /* write elision as in acerhdf_update_fanstate */
+    if (state != r->written ||
+            (r->refresh && now - r->written_at >= r->refresh)) {
+        ec_write(REPLAY_FANREG, state);
+        r->written = state;
+        r->written_at = now;
+    }
+
+    return state;
+}
+
+static int trace_add(struct trace *t, unsigned int time, int temp) {
+    if (t->n == t->alloc) {
+        size_t alloc = t->alloc ? t->alloc * 2 : 4096;
+        unsigned int *tm = realloc(t->time, alloc * sizeof (*tm));
+        int *tp;
+
+        if (!tm)
+            return -ENOMEM;
+        t->time = tm;
+        tp = realloc(t->temp, alloc * sizeof (*tp));
+        if (!tp)
+            return -ENOMEM;
+        t->temp = tp;
+        t->alloc = alloc;
+    }
+    t->time[t->n] = time;
+    t->temp[t->n] = temp;
+    t->n++;
+
+    return 0;
+}
+
+static int trace_load(struct trace *t, FILE *in, const char *name,
+        unsigned int interval) {
+    char line[256];
+    unsigned long lineno = 0;
+    unsigned int time = 0;
+    long long a, b;
+    int n;
+
+    while (fgets(line, sizeof (line), in)) {
+        lineno++;
+        line[strcspn(line, "#")] = '\0';
+        n = sscanf(line, "%lld %lld", &a, &b);
+        if (n <= 0)
+            continue;
+        if (n == 1) {
+            b = a;
+            a = time;
+            time += interval;
+        }
+        if (a < 0 || b < -273000 || b > 255000 ||
+                (t->n && (unsigned int) a < t->time[t->n - 1])) {
+            fprintf(stderr, "%s:%lu: bad sample\n", name, lineno);
+            return -EINVAL;
+        }
+        if (trace_add(t, a, b))
+            return -ENOMEM;
+    }
+
+    return 0;
+}
+
+/*
+ * Synthetic load: 45C idle with bursts of full load every few minutes, the
+ * package heating and cooling with a ~20s time constant, whole degrees like
+ * the EC reports them. Deterministic, so runs are comparable.
+ */
+static int trace_synthetic(struct trace *t, unsigned int hours,
+        unsigned int interval) {
+    unsigned int seed = 1, time, burst_end = 0, next_burst = 60000;
+    unsigned int end = hours * 3600000u;
+    double temp = 45.0, target;
+    int noise;
+
+    for (time = 0; time < end; time += interval) {
+        if (time >= next_burst) {
+            seed = seed * 1103515245 + 12345;
+            burst_end = time + 60000 + (seed >> 16) % 180000;
+            next_burst = burst_end + 120000 + (seed >> 8) % 480000;
+        }
+        target = time < burst_end ? 88.0 : 45.0;
+        temp += (target - temp) * interval / 20000.0;
+        seed = seed * 1103515245 + 12345;
+        noise = (int) ((seed >> 16) % 3) - 1;
+        if (trace_add(t, time, ((int) temp + noise) * 1000))
+            return -ENOMEM;
+    }
+
+    return 0;
+}
+
+static int parse_thresholds(const char *val, int *thr, unsigned int *n) {
+    char *buf = strdup(val), *p = buf, *tok;
+    unsigned int v;
+    int err = 0;
+
+    if (!buf)
+        return -ENOMEM;
+    *n = 0;
+    while ((tok = strsep(&p, ","))) {
+        if (*n == REPLAY_MAX_THRESHOLDS || kstrtouint(tok, 10, &v) ||
+                v > U8_MAX) {
+            err = -EINVAL;
+            break;
+        }
+        thr[(*n)++] = v;
+    }
+    free(buf);
+
+    return err;
+}
+
+static u64 now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+"usage: %s [options] [trace|-]\n"
+"  -c curve     fan curve, default \"" ACERHDF_DEFAULT_CURVE "\"\n"
+"  -f filter    box, ema, median or twa, default box\n"
+"  -w window    box and median window in samples, default %d\n"
+"  -a alpha     ema weight n/256, default 64\n"
+"  -s span      twa span in ms, default %d\n"
+"  -i interval  seconds between samples without timestamps, default 1\n"
+"  -u ramp_up   states per second up, default %d = immediately\n"
+"  -d ramp_down states per second down, default %d\n"
+"  -D dwell     ms in a state before stepping down, default %d\n"
+"  -E temp      emergency bypass temperature, default %d\n"
+"  -R rate      emergency bypass rise in degrees/s, default %d, 0 = off\n"
+"  -r refresh   rewrite an unchanged state every N seconds, default 30\n"
+"  -t list      thresholds in degrees, default 50,70,85\n"
+"  -n passes    timed passes over the trace for the step cost, default 10\n"
+"  -S hours     replay a synthetic trace of this length instead\n",
+            prog, TEMPERATURE_SAMPLES, TEMPERATURE_SAMPLES * 1000,
+            ACERHDF_DEFAULT_RAMP_UP, ACERHDF_DEFAULT_RAMP_DOWN,
+            ACERHDF_DEFAULT_DOWN_DWELL_MS, ACERHDF_DEFAULT_EMERGENCY_TEMP,
+            ACERHDF_DEFAULT_EMERGENCY_RATE);
+}
+
+int main(int argc, char **argv) {
+    const char *curve_str = ACERHDF_DEFAULT_CURVE;
+    int thr[REPLAY_MAX_THRESHOLDS] = { 50, 70, 85 };
+    unsigned int nthr = 3, interval = 1, refresh = 30, passes = 10;
+    unsigned int synthetic = 0, filter = ACERHDF_FILTER_BOX;
+    u64 above_raw[REPLAY_MAX_THRESHOLDS] = { 0 };
+    u64 above_filtered[REPLAY_MAX_THRESHOLDS] = { 0 };
+    u64 state_ms[ACERHDF_MAX_STATE + 1] = { 0 };
+    u64 duration = 0, t0, elapsed;
+    unsigned long transitions = 0, writes, emergencies;
+    static struct acerhdf_curve curve;
+    struct trace trace = { 0 };
+    struct replay r;
+    const char *name = "-";
+    volatile int sink;
+    int opt, state, last = -1, filtered;
+    unsigned int i, p, dt;
+    size_t k;
+
+    memset(&r, 0, sizeof (r));
+    r.cfg.window = TEMPERATURE_SAMPLES;
+    r.cfg.alpha = 64;
+    r.cfg.span = TEMPERATURE_SAMPLES * 1000;
+    r.shape_cfg.ramp_up = ACERHDF_DEFAULT_RAMP_UP;
+    r.shape_cfg.ramp_down = ACERHDF_DEFAULT_RAMP_DOWN;
+    r.shape_cfg.down_dwell_ms = ACERHDF_DEFAULT_DOWN_DWELL_MS;
+    r.emergency_cfg.temp = ACERHDF_DEFAULT_EMERGENCY_TEMP;
+    r.emergency_cfg.rate = ACERHDF_DEFAULT_EMERGENCY_RATE;
+
+    while ((opt = getopt(argc, argv, "c:f:w:a:s:u:d:D:E:R:i:r:t:n:S:h")) != -1) {
+        switch (opt) {
+        case 'c':
+            curve_str = optarg;
+            break;
+        case 'f':
+            for (filter = 0; filter < ARRAY_SIZE(acerhdf_filters); filter++)
+                if (!strcmp(optarg, acerhdf_filters[filter].name))
+                    break;
+            if (filter == ARRAY_SIZE(acerhdf_filters))
+                goto bad;
+            break;
+        case 'w':
+            if (kstrtouint(optarg, 10, &r.cfg.window) || !r.cfg.window ||
+                    r.cfg.window > ACERHDF_FILTER_MAX_WINDOW)
+                goto bad;
+            break;
+        case 'a':
+            if (kstrtouint(optarg, 10, &r.cfg.alpha) || !r.cfg.alpha ||
+                    r.cfg.alpha > 256)
+                goto bad;
+            break;
+        case 's':
+            if (kstrtouint(optarg, 10, &r.cfg.span) || r.cfg.span < 100 ||
+                    r.cfg.span > 60000)
+                goto bad;
+            break;
+        case 'u':
+            if (kstrtouint(optarg, 10, &r.shape_cfg.ramp_up) ||
+                    r.shape_cfg.ramp_up > ACERHDF_MAX_STATE)
+                goto bad;
+            break;
+        case 'd':
+            if (kstrtouint(optarg, 10, &r.shape_cfg.ramp_down) ||
+                    r.shape_cfg.ramp_down > ACERHDF_MAX_STATE)
+                goto bad;
+            break;
+        case 'D':
+            if (kstrtouint(optarg, 10, &r.shape_cfg.down_dwell_ms) ||
+                    r.shape_cfg.down_dwell_ms > 600000)
+                goto bad;
+            break;
+        case 'E':
+            if (kstrtouint(optarg, 10, &r.emergency_cfg.temp) ||
+                    r.emergency_cfg.temp < 40 || r.emergency_cfg.temp > 89)
+                goto bad;
+            break;
+        case 'R':
+            if (kstrtouint(optarg, 10, &r.emergency_cfg.rate) ||
+                    r.emergency_cfg.rate > 100)
+                goto bad;
+            break;
+        case 'i':
+            if (kstrtouint(optarg, 10, &interval) || !interval ||
+                    interval > 3600)
+                goto bad;
+            break;
+        case 'r':
+            if (kstrtouint(optarg, 10, &refresh) || refresh > 3600)
+                goto bad;
+            break;
+        case 't':
+            if (parse_thresholds(optarg, thr, &nthr))
+                goto bad;
+            break;
+        case 'n':
+            if (kstrtouint(optarg, 10, &passes))
+                goto bad;
+            break;
+        case 'S':
+            if (kstrtouint(optarg, 10, &synthetic) || !synthetic ||
+                    synthetic > 24 * 365)
+                goto bad;
+            break;
+        default:
+            goto bad;
+        }
+    }
+    if (optind < argc - 1)
+        goto bad;
+
+    if (acerhdf_parse_curve(curve_str, &curve)) {
+        fprintf(stderr, "invalid curve \"%s\"\n", curve_str);
+        return 2;
+    }
+    acerhdf_compile_curve(&curve);
+
+    r.curve = &curve;
+    r.ops = &acerhdf_filters[filter];
+    r.cfg.period = interval * 1000;
+    r.refresh = refresh * 1000;
+
+    if (synthetic) {
+        name = "synthetic";
+        if (trace_synthetic(&trace, synthetic, interval * 1000))
+            goto nomem;
+    } else {
+        FILE *in = stdin;
+        int err;
+
+        if (optind < argc && strcmp(argv[optind], "-")) {
+            name = argv[optind];
+            in = fopen(name, "r");
+            if (!in) {
+                perror(name);
+                return 1;
+            }
+        }
+        err = trace_load(&trace, in, name, interval * 1000);
+        if (in != stdin)
+            fclose(in);
+        if (err == -ENOMEM)
+            goto nomem;
+        if (err)
+            return 1;
+    }
+    if (!trace.n) {
+        fprintf(stderr, "%s: empty trace\n", name);
+        return 1;
+    }
+
+    /* each sample stands for the time until the next one */
+    replay_reset(&r);
+    for (k = 0; k < trace.n; k++) {
+        dt = k + 1 < trace.n ? trace.time[k + 1] - trace.time[k] :
+                interval * 1000;
+        state = replay_step(&r, trace.temp[k], trace.time[k], &filtered);
+
+        for (i = 0; i < nthr; i++) {
+            if (trace.temp[k] >= thr[i] * 1000)
+                above_raw[i] += dt;
+            if (filtered >= thr[i] * 1000)
+                above_filtered[i] += dt;
+        }
+        state_ms[state] += dt;
+        if (last >= 0 && state != last)
+            transitions++;
+        last = state;
+        duration += dt;
+    }
+    writes = ec_writes;
+    emergencies = r.emergencies;
+
+    /* the same steps again, timed, without the bookkeeping */
+    t0 = now_ns();
+    for (p = 0; p < passes; p++) {
+        replay_reset(&r);
+        for (k = 0; k < trace.n; k++)
+            sink = replay_step(&r, trace.temp[k], trace.time[k], &filtered);
+    }
+    elapsed = now_ns() - t0;
+    (void) sink;
+
+    printf("trace        %s, %zu samples, %.2f h\n", name, trace.n,
+            duration / 3600000.0);
+    printf("curve        %s\n", curve_str);
+    printf("filter       %s\n", r.ops->name);
+    printf("ec writes    %lu (fan_refresh %u s)\n", writes, refresh);
+    printf("transitions  %lu, %.1f/h\n", transitions,
+            transitions * 3600000.0 / duration);
+    printf("emergencies  %lu\n", emergencies);
+    if (passes)
+        printf("step cost    %.1f ns (%u passes)\n",
+                (double) elapsed / ((double) passes * trace.n), passes);
+    printf("\nabove      raw                filtered\n");
+    for (i = 0; i < nthr; i++)
+        printf("%3d C  %9.0f s %6.2f%%  %9.0f s %6.2f%%\n", thr[i],
+                above_raw[i] / 1000.0, above_raw[i] * 100.0 / duration,
+                above_filtered[i] / 1000.0,
+                above_filtered[i] * 100.0 / duration);
+    printf("\nstate  time\n");
+    for (i = 0; i <= ACERHDF_MAX_STATE; i++)
+        if (state_ms[i])
+            printf("%5u  %9.0f s %6.2f%%\n", i, state_ms[i] / 1000.0,
+                    state_ms[i] * 100.0 / duration);
+
+    free(trace.time);
+    free(trace.temp);
+    return 0;
+
+bad:
+    usage(argv[0]);
+    return 2;
+nomem:
+    fprintf(stderr, "out of memory\n");
+    return 1;
+}
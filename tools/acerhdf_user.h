@@ -0,0 +1,66 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * The few kernel helpers acerhdf_ctl.h uses, for building it in userspace.
+ */
+#ifndef _ACERHDF_USER_H
+#define _ACERHDF_USER_H
+
+#include <errno.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef uint8_t u8;
+typedef uint32_t u32;
+typedef int64_t s64;
+typedef uint64_t u64;
+
+#define U8_MAX 255
+#define GFP_KERNEL 0
+#define ARRAY_SIZE(a) (sizeof (a) / sizeof ((a)[0]))
+#define DIV_ROUND_UP(n, d) (((n) + (d) - 1) / (d))
+
+#define min_t(type, a, b) ((type) (a) < (type) (b) ? (type) (a) : (type) (b))
+#define max_t(type, a, b) ((type) (a) > (type) (b) ? (type) (a) : (type) (b))
+#define clamp_t(type, v, lo, hi) min_t(type, max_t(type, v, lo), hi)
+
+static inline s64 div_s64(s64 dividend, s64 divisor) {
+    return dividend / divisor;
+}
+
+static inline char *kstrdup(const char *s, int gfp) {
+    (void) gfp;
+    return strdup(s);
+}
+
+static inline void kfree(const void *p) {
+    free((void *) p);
+}
+
+/* like the kernel's: one trailing newline allowed, no sign, no overflow */
+static inline int kstrtouint(const char *s, unsigned int base,
+        unsigned int *res) {
+    unsigned long long v = 0;
+    const char *p = s;
+
+    if (*p == '+')
+        p++;
+    if (*p < '0' || *p > '9')
+        return -EINVAL;
+    for (; *p >= '0' && *p <= '9'; p++) {
+        v = v * base + (*p - '0');
+        if (v > UINT_MAX)
+            return -ERANGE;
+    }
+    if (*p == '\n')
+        p++;
+    if (*p)
+        return -EINVAL;
+
+    *res = v;
+    return 0;
+}
+
+#endif /* _ACERHDF_USER_H */